@@ -8,6 +8,11 @@
 #define GET_COL(x) ((x) % BOARD_SIZE)
 #define GET_ROW(x) ((x) / BOARD_SIZE)
 
+/* Move returned by a search that used up its time slice before its deadline.
+ * Calling it again on the same position resumes it.
+ */
+#define SEARCH_YIELD (-2)
+
 #define for_each_empty_grid(i, table) \
     for (int i = 0; i < N_GRIDS; i++) \
         if (table[i] == ' ')
@@ -0,0 +1,111 @@
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+
+#include "game.h"
+#include "kxo_board.h"
+
+/* 16 MiB of boards */
+#define KXO_BOARDS_MAX (1U << 20)
+
+static void kxo_board_write(struct kxo_boards *boards,
+                            u32 id,
+                            const char *table,
+                            char turn,
+                            char win)
+{
+    struct kxo_board *board = &boards->boards[id];
+    u16 o = 0, x = 0;
+
+    for (int i = 0; i < N_GRIDS; i++) {
+        char c = READ_ONCE(table[i]);
+        if (c == 'O')
+            o |= 1U << i;
+        else if (c == 'X')
+            x |= 1U << i;
+    }
+
+    /* The protocol of a seqcount_t, on a counter userspace can map */
+    spin_lock(&boards->lock);
+    WRITE_ONCE(board->seq, board->seq + 1);
+    smp_wmb();
+    board->o = o;
+    board->x = x;
+    board->move_nr = hweight16(o | x);
+    board->turn = win == ' ' ? turn : 0;
+    board->result = win == ' ' ? 0 : win;
+    if (win != ' ')
+        board->games++;
+    smp_store_release(&board->seq, board->seq + 1);
+    spin_unlock(&boards->lock);
+}
+
+int kxo_board_mmap(TidData *tid_data, struct vm_area_struct *vma)
+{
+    size_t size = vma->vm_end - vma->vm_start;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    struct kxo_boards *boards = READ_ONCE(tid_data->boards);
+    if (!boards) {
+        if (size % sizeof(struct kxo_board) ||
+            size / sizeof(struct kxo_board) > KXO_BOARDS_MAX)
+            return -EINVAL;
+        boards = kmalloc(sizeof(*boards), GFP_KERNEL);
+        if (!boards)
+            return -ENOMEM;
+        boards->boards = vmalloc_user(size);
+        if (!boards->boards) {
+            kfree(boards);
+            return -ENOMEM;
+        }
+        spin_lock_init(&boards->lock);
+        boards->nr = size / sizeof(struct kxo_board);
+
+        /* Mapped by another thread meanwhile */
+        struct kxo_boards *old = cmpxchg(&tid_data->boards, NULL, boards);
+        if (old) {
+            kxo_board_free(boards);
+            boards = old;
+        } else {
+            /* After publishing, a game moving meanwhile writes its board
+             * again after this
+             */
+            UserData *user_data;
+            unsigned long id;
+            xa_for_each_range(&tid_data->games, id, user_data, 0,
+                              boards->nr - 1)
+                kxo_board_write(boards, id, user_data->table,
+                                READ_ONCE(user_data->turn), ' ');
+        }
+    }
+
+    if (size != (size_t) boards->nr * sizeof(struct kxo_board))
+        return -EBUSY;
+    return remap_vmalloc_range(vma, boards->boards, 0);
+}
+
+void kxo_board_update(UserData *user_data, char win)
+{
+    /* Published when mapped, the boards are set up by then */
+    struct kxo_boards *boards = smp_load_acquire(&user_data->tid_data->boards);
+
+    if (boards && user_data->id < boards->nr)
+        kxo_board_write(boards, user_data->id, user_data->table,
+                        user_data->turn, win);
+}
+
+void kxo_board_free(struct kxo_boards *boards)
+{
+    if (!boards)
+        return;
+    vfree(boards->boards);
+    kfree(boards);
+}
@@ -0,0 +1,40 @@
+#ifndef KXO_BOARD_H
+#define KXO_BOARD_H
+
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+
+#include "kxo_ioctl.h"
+#include "type.h"
+
+/* Board snapshots of a session, see KXO_MMAP_BOARDS */
+struct kxo_boards {
+    spinlock_t lock;  // one writer per board, even while the mapping is set up
+    u32 nr;
+    struct kxo_board *boards;  // vmalloc_user'd, mapped by userspace
+};
+
+/**
+ * kxo_board_mmap - Map the board snapshots of a session, creating them on
+ * the first call.
+ *
+ * @tid_data: The session.
+ * @vma: A read-only mapping at KXO_MMAP_BOARDS.
+ *
+ * Return: 0, -EPERM for a writable mapping, -EINVAL for one of the wrong
+ * size, -EBUSY if the snapshots exist with another size, -ENOMEM.
+ */
+int kxo_board_mmap(TidData *tid_data, struct vm_area_struct *vma);
+
+/**
+ * kxo_board_update - Publish the position of a game after a move.
+ *
+ * @user_data: The game, before its table is reset if the move ended it.
+ * @win: check_win() of the table.
+ */
+void kxo_board_update(UserData *user_data, char win);
+
+// once nothing is mapped nor updates any more
+void kxo_board_free(struct kxo_boards *boards);
+
+#endif
@@ -0,0 +1,267 @@
+#include <linux/device.h>
+#include <linux/hashtable.h>
+#include <linux/memcontrol.h>
+#include <linux/module.h>
+#include <linux/pid.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+
+#include "kxo_budget.h"
+
+/* Shortest search a process out of budget still gets */
+#define KXO_BUDGET_MIN_NS NSEC_PER_MSEC
+
+static unsigned int cpu_share;
+module_param(cpu_share, uint, 0644);
+MODULE_PARM_DESC(cpu_share,
+                 "AI compute a process may use, in percent of one CPU "
+                 "(0 for no limit)");
+
+static unsigned int cpu_burst_ms = 100;
+module_param(cpu_burst_ms, uint, 0644);
+MODULE_PARM_DESC(cpu_burst_ms,
+                 "AI compute a process may save up, in ms of one CPU");
+
+static unsigned long search_mem_kb = 131072;
+module_param(search_mem_kb, ulong, 0644);
+MODULE_PARM_DESC(search_mem_kb,
+                 "Search memory a process may use, in KiB (0 for no limit)");
+
+static atomic64_t deferred, reduced, mem_failures;
+
+/* Budgets of the processes with a session open, by thread group. Opening
+ * the device again does not give a process more.
+ */
+static DEFINE_HASHTABLE(budgets, 6);
+static DEFINE_SPINLOCK(budgets_lock);
+static atomic_t nr_budgets;
+
+static struct kxo_budget *kxo_budget_alloc_current(void)
+{
+    struct kxo_budget *budget = kmalloc(sizeof(*budget), GFP_KERNEL);
+
+    if (!budget)
+        return NULL;
+    spin_lock_init(&budget->lock);
+    budget->tokens = (s64) READ_ONCE(cpu_burst_ms) * NSEC_PER_MSEC;
+    budget->stamp = ktime_get();
+    atomic_long_set(&budget->mem, 0);
+    budget->memcg = get_mem_cgroup_from_mm(current->mm);
+    budget->tgid = get_pid(task_tgid(current));
+    refcount_set(&budget->ref, 1);
+    return budget;
+}
+
+static void kxo_budget_free_one(struct kxo_budget *budget)
+{
+    WARN_ON_ONCE(atomic_long_read(&budget->mem));
+    mem_cgroup_put(budget->memcg);
+    put_pid(budget->tgid);
+    kfree(budget);
+}
+
+/* Called with budgets_lock held */
+static struct kxo_budget *kxo_budget_find(struct pid *tgid)
+{
+    struct kxo_budget *budget;
+
+    hash_for_each_possible(budgets, budget, node, (unsigned long) tgid) {
+        if (budget->tgid == tgid) {
+            refcount_inc(&budget->ref);
+            return budget;
+        }
+    }
+    return NULL;
+}
+
+struct kxo_budget *kxo_budget_get(void)
+{
+    struct pid *tgid = task_tgid(current);
+    struct kxo_budget *budget, *new;
+
+    spin_lock(&budgets_lock);
+    budget = kxo_budget_find(tgid);
+    spin_unlock(&budgets_lock);
+    if (budget)
+        return budget;
+
+    new = kxo_budget_alloc_current();
+    if (!new)
+        return NULL;
+
+    /* Created by another thread of the process meanwhile */
+    spin_lock(&budgets_lock);
+    budget = kxo_budget_find(tgid);
+    if (!budget) {
+        hash_add(budgets, &new->node, (unsigned long) tgid);
+        atomic_inc(&nr_budgets);
+        budget = new;
+        new = NULL;
+    }
+    spin_unlock(&budgets_lock);
+
+    if (new)
+        kxo_budget_free_one(new);
+    return budget;
+}
+
+void kxo_budget_put(struct kxo_budget *budget)
+{
+    /* Out of the table before anyone can find it with no reference left */
+    if (!refcount_dec_and_lock(&budget->ref, &budgets_lock))
+        return;
+    hash_del(&budget->node);
+    atomic_dec(&nr_budgets);
+    spin_unlock(&budgets_lock);
+    kxo_budget_free_one(budget);
+}
+
+/* Called with budget->lock held */
+static void kxo_budget_refill(struct kxo_budget *budget,
+                              unsigned int share,
+                              ktime_t now)
+{
+    s64 burst = (s64) READ_ONCE(cpu_burst_ms) * NSEC_PER_MSEC;
+    s64 elapsed = ktime_to_ns(ktime_sub(now, budget->stamp));
+
+    budget->stamp = now;
+    if (elapsed > 0)
+        budget->tokens += div_u64((u64) elapsed * share, 100);
+    if (budget->tokens > burst)
+        budget->tokens = burst;
+}
+
+bool kxo_budget_admit(struct kxo_budget *budget, ktime_t *until)
+{
+    unsigned int share = READ_ONCE(cpu_share);
+    ktime_t now = ktime_get();
+    s64 tokens;
+
+    if (!share)
+        return true;
+
+    spin_lock(&budget->lock);
+    kxo_budget_refill(budget, share, now);
+    tokens = budget->tokens;
+    spin_unlock(&budget->lock);
+
+    if (tokens > 0)
+        return true;
+
+    /* Come back when the debt is paid and a minimal search is affordable */
+    *until = ktime_add_ns(
+        now, div_u64((u64) (KXO_BUDGET_MIN_NS - tokens) * 100, share));
+    atomic64_inc(&deferred);
+    return false;
+}
+
+ktime_t kxo_budget_deadline(struct kxo_budget *budget, u64 want_ns)
+{
+    unsigned int share = READ_ONCE(cpu_share);
+    ktime_t now = ktime_get();
+    s64 tokens;
+
+    if (!share)
+        return ktime_add_ns(now, want_ns);
+
+    spin_lock(&budget->lock);
+    kxo_budget_refill(budget, share, now);
+    tokens = budget->tokens;
+    spin_unlock(&budget->lock);
+
+    if (tokens >= (s64) want_ns)
+        return ktime_add_ns(now, want_ns);
+    atomic64_inc(&reduced);
+    return ktime_add_ns(now, max_t(s64, tokens, KXO_BUDGET_MIN_NS));
+}
+
+void kxo_budget_charge(struct kxo_budget *budget, u64 ns)
+{
+    if (!READ_ONCE(cpu_share))
+        return;
+
+    spin_lock(&budget->lock);
+    budget->tokens -= ns;
+    spin_unlock(&budget->lock);
+}
+
+struct mem_cgroup *kxo_budget_enter(struct kxo_budget *budget)
+{
+    return set_active_memcg(budget->memcg);
+}
+
+void kxo_budget_leave(struct mem_cgroup *old)
+{
+    set_active_memcg(old);
+}
+
+void *kxo_budget_alloc(struct kxo_budget *budget, size_t size)
+{
+    long limit = READ_ONCE(search_mem_kb) * 1024;
+    long used = atomic_long_add_return(size, &budget->mem);
+    void *ptr;
+
+    if (limit && used > limit)
+        goto over_limit;
+
+    ptr = kzalloc(size, GFP_KERNEL | __GFP_ACCOUNT);
+    if (!ptr)
+        goto over_limit;
+    return ptr;
+
+over_limit:
+    atomic_long_sub(size, &budget->mem);
+    atomic64_inc(&mem_failures);
+    return NULL;
+}
+
+void kxo_budget_free(struct kxo_budget *budget, void *ptr, size_t size)
+{
+    kfree(ptr);
+    atomic_long_sub(size, &budget->mem);
+}
+
+static ssize_t processes_show(struct device *dev,
+                              struct device_attribute *attr,
+                              char *buf)
+{
+    return sysfs_emit(buf, "%d\n", atomic_read(&nr_budgets));
+}
+static DEVICE_ATTR_RO(processes);
+
+static ssize_t deferred_show(struct device *dev,
+                             struct device_attribute *attr,
+                             char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&deferred));
+}
+static DEVICE_ATTR_RO(deferred);
+
+static ssize_t reduced_show(struct device *dev,
+                            struct device_attribute *attr,
+                            char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&reduced));
+}
+static DEVICE_ATTR_RO(reduced);
+
+static ssize_t mem_failures_show(struct device *dev,
+                                 struct device_attribute *attr,
+                                 char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&mem_failures));
+}
+static DEVICE_ATTR_RO(mem_failures);
+
+static struct attribute *kxo_budget_attrs[] = {
+    &dev_attr_processes.attr,
+    &dev_attr_deferred.attr,
+    &dev_attr_reduced.attr,
+    &dev_attr_mem_failures.attr,
+    NULL,
+};
+
+const struct attribute_group kxo_budget_group = {
+    .name = "budget",
+    .attrs = kxo_budget_attrs,
+};
@@ -0,0 +1,78 @@
+#ifndef KXO_BUDGET_H
+#define KXO_BUDGET_H
+
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/refcount.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+
+struct mem_cgroup;
+struct pid;
+
+/* AI compute budget of a process, shared by all the sessions it opens. CPU
+ * time is a token bucket of nanoseconds refilled at cpu_share percent of one
+ * CPU, holding at most cpu_burst_ms. Search memory is capped at
+ * search_mem_kb and charged to the memory cgroup of the process.
+ */
+struct kxo_budget {
+    spinlock_t lock;
+    s64 tokens;  // negative after a move costlier than what was left
+    ktime_t stamp;
+    atomic_long_t mem;  // bytes of search memory in use
+    struct mem_cgroup *memcg;
+
+    struct pid *tgid;  // of the process, pinned so it is not reused
+    refcount_t ref;    // one per session
+    struct hlist_node node;
+};
+
+/* Budget statistics, a "budget" directory of the device */
+extern const struct attribute_group kxo_budget_group;
+
+/**
+ * kxo_budget_get - Budget of the calling process, created on its first
+ * session.
+ *
+ * Return: The budget, to release with kxo_budget_put(), or NULL if out of
+ * memory.
+ */
+struct kxo_budget *kxo_budget_get(void);
+void kxo_budget_put(struct kxo_budget *budget);
+
+/**
+ * kxo_budget_admit - Check whether a process may start a move.
+ *
+ * @budget: The budget of the process.
+ * @until: Set to the time the budget is refilled enough, if it is not.
+ *
+ * Return: false if the CPU budget is spent.
+ */
+bool kxo_budget_admit(struct kxo_budget *budget, ktime_t *until);
+
+/**
+ * kxo_budget_deadline - Deadline of a search within the CPU budget.
+ *
+ * @budget: The budget of the process.
+ * @want_ns: Time the scheduler grants the search.
+ *
+ * Return: want_ns from now, or less if that much is not left, but never
+ * less than a millisecond.
+ */
+ktime_t kxo_budget_deadline(struct kxo_budget *budget, u64 want_ns);
+
+// take the time a move took from the budget
+void kxo_budget_charge(struct kxo_budget *budget, u64 ns);
+
+/* Make the search allocations of the caller accounted to the memory cgroup
+ * of the process. Returns what to pass to kxo_budget_leave().
+ */
+struct mem_cgroup *kxo_budget_enter(struct kxo_budget *budget);
+void kxo_budget_leave(struct mem_cgroup *old);
+
+/* Zeroed search memory, NULL past the cap of the process */
+void *kxo_budget_alloc(struct kxo_budget *budget, size_t size);
+void kxo_budget_free(struct kxo_budget *budget, void *ptr, size_t size);
+
+#endif
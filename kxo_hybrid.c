@@ -0,0 +1,231 @@
+#include <linux/device.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+#include "kxo_hybrid.h"
+#include "mcts.h"
+
+/* Positions with at most this many empty squares may be solved: searched to
+ * the end of the game whatever the deadline, if the solves learned so far
+ * fit before it
+ */
+#define KXO_SOLVE_EMPTY 8
+
+/* Positions with at least this many empty squares are the opening, where
+ * MCTS plays better than a shallow negamax
+ */
+#define KXO_OPENING_EMPTY 12
+
+/* Weight of a new cost sample, 1 / 2^KXO_COST_SHIFT */
+#define KXO_COST_SHIFT 3
+
+static const char *const method_names[NR_KXO_METHODS] = {
+    [KXO_METHOD_BOOK] = "book",       [KXO_METHOD_FORCED] = "forced",
+    [KXO_METHOD_SOLVE] = "solve",     [KXO_METHOD_NEGAMAX] = "negamax",
+    [KXO_METHOD_MCTS] = "mcts",
+};
+
+/* The central squares, the strongest first moves on a 4x4 board */
+static const int book_moves[] = {5, 10, 6, 9};
+
+/* Learned cost model: average time each method took to find a move, by
+ * number of empty squares, 0 while unknown. Updated without a lock, a lost
+ * sample does not matter.
+ */
+static u64 cost_ns[NR_KXO_METHODS][N_GRIDS + 1];
+
+/* Time of one MCTS iteration, by number of empty squares, 0 while unknown.
+ * Runs cut by the deadline teach it as well.
+ */
+static u64 mcts_iteration_ns[N_GRIDS + 1];
+
+static void kxo_cost_learn(u64 *cost, u64 sample)
+{
+    u64 old = READ_ONCE(*cost);
+
+    WRITE_ONCE(*cost, old ? old - (old >> KXO_COST_SHIFT) +
+                                (sample >> KXO_COST_SHIFT)
+                          : sample);
+}
+
+static atomic64_t method_moves[NR_KXO_METHODS], method_ns[NR_KXO_METHODS];
+
+static int count_empty(const char *table)
+{
+    int n_empty = 0;
+    for_each_empty_grid(i, table)
+        n_empty++;
+    return n_empty;
+}
+
+/* First empty square where player would complete a line, -1 if none */
+static int winning_move(const char *table, char player)
+{
+    char t[N_GRIDS];
+
+    memcpy(t, table, N_GRIDS);
+    for_each_empty_grid(i, table) {
+        t[i] = player;
+        if (check_win(t) == player)
+            return i;
+        t[i] = ' ';
+    }
+    return -1;
+}
+
+static int kxo_hybrid_choose(struct kxo_hybrid *hybrid,
+                             const char *table,
+                             char player,
+                             ktime_t deadline)
+{
+    int n_empty = count_empty(table);
+
+    if (n_empty >= N_GRIDS - 1) {
+        for (int i = 0; i < ARRAY_SIZE(book_moves); i++) {
+            if (table[book_moves[i]] == ' ') {
+                hybrid->move = book_moves[i];
+                return KXO_METHOD_BOOK;
+            }
+        }
+    }
+
+    hybrid->move = winning_move(table, player);
+    if (hybrid->move < 0)
+        hybrid->move = winning_move(table, player ^ 'O' ^ 'X');
+    if (hybrid->move >= 0)
+        return KXO_METHOD_FORCED;
+
+    s64 left = ktime_to_ns(ktime_sub(deadline, ktime_get()));
+    u64 solve = READ_ONCE(cost_ns[KXO_METHOD_SOLVE][n_empty]);
+    if (n_empty <= KXO_SOLVE_EMPTY && (s64) solve < left)
+        return KXO_METHOD_SOLVE;
+
+    /* MCTS only if it can run all its iterations. Before a run did, the time
+     * of an iteration tells, and before that is known MCTS is tried once,
+     * cut by the deadline, to time it.
+     */
+    if (n_empty >= KXO_OPENING_EMPTY) {
+        u64 mcts = READ_ONCE(cost_ns[KXO_METHOD_MCTS][n_empty]);
+        u64 iteration = READ_ONCE(mcts_iteration_ns[n_empty]);
+        if (!mcts)
+            mcts = iteration * ITERATIONS;
+        if (!iteration || (s64) mcts < left)
+            return KXO_METHOD_MCTS;
+    }
+    return KXO_METHOD_NEGAMAX;
+}
+
+int kxo_hybrid_pick(struct kxo_hybrid *hybrid,
+                    const char *table,
+                    char player,
+                    ktime_t deadline)
+{
+    if (hybrid->searching && hybrid->player == player &&
+        !memcmp(hybrid->table, table, N_GRIDS))
+        return hybrid->method;
+
+    memcpy(hybrid->table, table, N_GRIDS);
+    hybrid->player = player;
+    hybrid->searching = false;
+    hybrid->ns = 0;
+    hybrid->method = kxo_hybrid_choose(hybrid, table, player, deadline);
+    return hybrid->method;
+}
+
+void kxo_hybrid_done(struct kxo_hybrid *hybrid,
+                     u64 ns,
+                     int move,
+                     int progress,
+                     bool ponder)
+{
+    int method = hybrid->method;
+    int n_empty = count_empty(hybrid->table);
+
+    hybrid->ns += ns;
+    hybrid->searching = move == SEARCH_YIELD;
+    if (hybrid->searching || ponder)
+        return;
+
+    /* The cost of a method is that of a complete run. Only an abort stops a
+     * solve short, the deadline may cut MCTS.
+     */
+    bool complete = true;
+    switch (method) {
+    case KXO_METHOD_SOLVE:
+        complete = progress >= n_empty;
+        break;
+    case KXO_METHOD_MCTS:
+        if (progress > 0)
+            kxo_cost_learn(&mcts_iteration_ns[n_empty],
+                           div_u64(hybrid->ns, progress));
+        complete = progress >= ITERATIONS;
+        break;
+    }
+    if (complete)
+        kxo_cost_learn(&cost_ns[method][n_empty], hybrid->ns);
+
+    atomic64_inc(&method_moves[method]);
+    atomic64_add(hybrid->ns, &method_ns[method]);
+    pr_info("kxo: hybrid move %d by %s in %llu usec, %d empty squares\n",
+            move, method_names[method],
+            (unsigned long long) hybrid->ns >> 10, n_empty);
+}
+
+/* Moves played by each method, and the average time one took */
+
+struct kxo_method_attribute {
+    struct device_attribute attr;
+    int method;
+};
+
+static ssize_t kxo_method_moves_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf)
+{
+    struct kxo_method_attribute *method_attr =
+        container_of(attr, struct kxo_method_attribute, attr);
+    return sysfs_emit(buf, "%lld\n",
+                      atomic64_read(&method_moves[method_attr->method]));
+}
+
+static ssize_t kxo_method_ns_show(struct device *dev,
+                                  struct device_attribute *attr,
+                                  char *buf)
+{
+    struct kxo_method_attribute *method_attr =
+        container_of(attr, struct kxo_method_attribute, attr);
+    s64 moves = atomic64_read(&method_moves[method_attr->method]);
+    s64 ns = atomic64_read(&method_ns[method_attr->method]);
+
+    return sysfs_emit(buf, "%lld\n", moves ? div64_s64(ns, moves) : 0);
+}
+
+#define KXO_METHOD_ATTRS(name, _method)                                    \
+    static struct kxo_method_attribute kxo_##name##_moves = {             \
+        .attr = __ATTR(name##_moves, 0444, kxo_method_moves_show, NULL),  \
+        .method = _method,                                                \
+    };                                                                    \
+    static struct kxo_method_attribute kxo_##name##_ns = {                \
+        .attr = __ATTR(name##_ns, 0444, kxo_method_ns_show, NULL),        \
+        .method = _method,                                                \
+    }
+
+KXO_METHOD_ATTRS(book, KXO_METHOD_BOOK);
+KXO_METHOD_ATTRS(forced, KXO_METHOD_FORCED);
+KXO_METHOD_ATTRS(solve, KXO_METHOD_SOLVE);
+KXO_METHOD_ATTRS(negamax, KXO_METHOD_NEGAMAX);
+KXO_METHOD_ATTRS(mcts, KXO_METHOD_MCTS);
+
+static struct attribute *kxo_hybrid_attrs[] = {
+    &kxo_book_moves.attr.attr,    &kxo_book_ns.attr.attr,
+    &kxo_forced_moves.attr.attr,  &kxo_forced_ns.attr.attr,
+    &kxo_solve_moves.attr.attr,   &kxo_solve_ns.attr.attr,
+    &kxo_negamax_moves.attr.attr, &kxo_negamax_ns.attr.attr,
+    &kxo_mcts_moves.attr.attr,    &kxo_mcts_ns.attr.attr,
+    NULL,
+};
+
+const struct attribute_group kxo_hybrid_group = {
+    .name = "hybrid",
+    .attrs = kxo_hybrid_attrs,
+};
@@ -0,0 +1,72 @@
+#ifndef KXO_HYBRID_H
+#define KXO_HYBRID_H
+
+#include <linux/ktime.h>
+#include <linux/sysfs.h>
+
+#include "game.h"
+
+/* Methods of the hybrid engine, cheapest first */
+enum kxo_method {
+    KXO_METHOD_BOOK,     // opening lookup
+    KXO_METHOD_FORCED,   // win now, or block the opponent's win
+    KXO_METHOD_SOLVE,    // negamax to the end of the game, without deadline
+    KXO_METHOD_NEGAMAX,  // negamax cut by the deadline
+    KXO_METHOD_MCTS,
+    NR_KXO_METHODS
+};
+
+/* Move of a hybrid engine, kept by the game across the slices of a search */
+struct kxo_hybrid {
+    char table[N_GRIDS];
+    char player;
+    bool searching;  // the method yielded on this position
+    int method;      // enum kxo_method
+    int move;        // found by the book or the threat check
+    u64 ns;          // time spent by the method so far
+};
+
+/* Hybrid engine statistics, a "hybrid" directory of the device */
+extern const struct attribute_group kxo_hybrid_group;
+
+/**
+ * kxo_hybrid_pick - Choose how to find the move of @player on @table.
+ *
+ * @hybrid: State of the game, which keeps the method of a resumed search.
+ * @table: Position to play in.
+ * @player: Side to move.
+ * @deadline: When the move has to be found.
+ *
+ * Opening positions are looked up, immediate wins and blocks are played
+ * outright. Otherwise the cost the methods took before at the same number of
+ * empty squares decides: an exact solve of an endgame if it fits before
+ * @deadline, MCTS in the opening if its full iteration count fits, negamax
+ * cut by @deadline otherwise. MCTS is tried once, whatever the deadline, to
+ * time its iterations.
+ *
+ * Return: The method, hybrid->move holds the move of the book and forced
+ * ones.
+ */
+int kxo_hybrid_pick(struct kxo_hybrid *hybrid,
+                    const char *table,
+                    char player,
+                    ktime_t deadline);
+
+/**
+ * kxo_hybrid_done - Account for a call of the method picked.
+ *
+ * @hybrid: State of the game.
+ * @ns: Time the call took.
+ * @move: What the method returned.
+ * @progress: Plies completed by a negamax search, iterations run by MCTS, to
+ * tell whether the method ran to its end.
+ * @ponder: Whether the search was speculative. It then neither teaches the
+ * cost model nor counts in the statistics.
+ */
+void kxo_hybrid_done(struct kxo_hybrid *hybrid,
+                     u64 ns,
+                     int move,
+                     int progress,
+                     bool ponder);
+
+#endif
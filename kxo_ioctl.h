@@ -1,18 +1,244 @@
 #ifndef KXO_IOCTL_H
 #define KXO_IOCTL_H
 
-enum IOCTL_TYPE { GET_USER_ID };
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Version 1 of the ABI: raw ioctl numbers and one-byte game ids, in the
+ * ioctls as well as in the first byte of read() and write() buffers. It only
+ * reaches the first 256 games of a session.
+ */
+enum IOCTL_TYPE { GET_USER_ID, SET_PACE, SET_QOS };
+
+/* Argument of SET_PACE. A pace of 0 lets the game move as fast as its
+ * engines can compute.
+ */
+struct kxo_pace {
+    unsigned char user_id;
+    unsigned int pace_us;
+};
+
+/* Scheduling class of a game. Replies to a human (interactive) are played by
+ * their own higher priority workers, ahead of self-play (background). A game
+ * with a USER_CTL side starts interactive, others start background.
+ */
+enum kxo_qos_class { KXO_QOS_INTERACTIVE, KXO_QOS_BACKGROUND, NR_KXO_QOS };
+
+/* Argument of SET_QOS */
+struct kxo_qos {
+    unsigned char user_id;
+    unsigned char qos;
+};
 
 typedef enum player_permission {
     USER_CTL = 0,
     MCTS = 1,
-    NEGAMAX = 2
+    NEGAMAX = 2,
+    HYBRID = 3  // picks the cheapest adequate method for each move
 } PlayerPermission;
 
+/* Version 2 of the ABI: 32-bit game ids. Fields are fixed-size and
+ * explicitly padded, structures only grow at their end.
+ */
+#define KXO_ABI_VERSION 2
+
+#define KXO_IOC_MAGIC 'x'
+
+/* Argument of KXO_IOC_NEW_GAME */
+struct kxo_new_game {
+    __u8 player1, player2; /* PlayerPermission of 'O' and 'X' */
+    __u8 pad[2];
+    __u32 game_id; /* out */
+};
+
+/* Argument of KXO_IOC_SET_PACE */
+struct kxo_game_pace {
+    __u32 game_id;
+    __u32 pace_us;
+};
+
+/* Argument of KXO_IOC_SET_QOS */
+struct kxo_game_qos {
+    __u32 game_id;
+    __u32 qos; /* enum kxo_qos_class */
+};
+
+/* Argument of KXO_IOC_PLAY, the move of the userspace player of a game. The
+ * result is encoded like the moves read from the game.
+ */
+struct kxo_play {
+    __u32 game_id;
+    __u8 move;
+    __u8 result; /* out */
+    __u8 pad[2];
+};
+
+/* Argument of KXO_IOC_READ, read() of the moves of one game */
+struct kxo_read {
+    __u32 game_id;
+    __u32 len;
+    __u64 buf; /* user pointer */
+};
+
+/* Argument of KXO_IOC_READ_EVENTS, which drains the moves of all the games
+ * of the file at once, blocking unless O_NONBLOCK until one has some.
+ */
+struct kxo_read_events {
+    __u64 buf; /* user pointer to an array of struct kxo_event */
+    __u32 nr;  /* room in buf, set to the number of events read */
+    __u32 pad;
+};
+
+/* Argument of KXO_IOC_FETCH_READY, which returns the number of games that
+ * played since the last fetch and clears their bits. Bit i of word w of buf
+ * is set for game first + 64 * w + i.
+ */
+struct kxo_ready {
+    __u64 buf;   /* user pointer to an array of __u64 */
+    __u32 first; /* multiple of 64 */
+    __u32 nr_words;
+};
+
+/* Argument of KXO_IOC_SET_EVENTFD, which registers an eventfd signalled on
+ * each move of a game, or of all the games of the file with
+ * KXO_EVENTFD_SESSION. A game and the file have at most one each, an fd of
+ * -1 unregisters it.
+ */
+#define KXO_EVENTFD_SESSION 0x1
+
+struct kxo_eventfd {
+    __s32 fd;
+    __u32 flags;
+    __u32 game_id;
+    __u32 pad;
+};
+
+/* KXO_IOC_PLAY and KXO_IOC_READ_EVENTS may also be submitted through
+ * io_uring, as IORING_OP_URING_CMD on the device with the ioctl number in
+ * cmd_op and the argument in the command area of the SQE. The CQE result is
+ * the encoded move of KXO_IOC_PLAY, or the number of events read, or
+ * -errno. The move and the events are not written back to the argument.
+ */
+
+#define KXO_IOC_VERSION _IOR(KXO_IOC_MAGIC, 0, __u32)
+#define KXO_IOC_NEW_GAME _IOWR(KXO_IOC_MAGIC, 1, struct kxo_new_game)
+#define KXO_IOC_SET_PACE _IOW(KXO_IOC_MAGIC, 2, struct kxo_game_pace)
+#define KXO_IOC_SET_QOS _IOW(KXO_IOC_MAGIC, 3, struct kxo_game_qos)
+#define KXO_IOC_PLAY _IOWR(KXO_IOC_MAGIC, 4, struct kxo_play)
+#define KXO_IOC_READ _IOW(KXO_IOC_MAGIC, 5, struct kxo_read)
+#define KXO_IOC_READ_EVENTS _IOWR(KXO_IOC_MAGIC, 6, struct kxo_read_events)
+#define KXO_IOC_FETCH_READY _IOW(KXO_IOC_MAGIC, 7, struct kxo_ready)
+#define KXO_IOC_SET_EVENTFD _IOW(KXO_IOC_MAGIC, 8, struct kxo_eventfd)
+#define KXO_IOC_SESSION_ID _IOR(KXO_IOC_MAGIC, 9, __u32)
+#define KXO_IOC_WATCH _IOW(KXO_IOC_MAGIC, 10, struct kxo_watch)
+#define KXO_IOC_WATCH_READ _IOWR(KXO_IOC_MAGIC, 11, struct kxo_watch_read)
+
+/* Event ring of a session, mapped shared at offset KXO_MMAP_EVENTS. The
+ * mapping is a page holding struct kxo_ring_header, followed by a power of
+ * two of struct kxo_event: its length picks the size of the ring. Once it is
+ * mapped, the moves of all the games of the session go to the ring instead
+ * of read().
+ *
+ * The kernel writes events at head and then stores head with release
+ * semantics. Userspace loads head with acquire semantics, consumes the events
+ * up to it and stores tail with release semantics. Indices wrap around and
+ * are taken modulo nr_events. Games stop computing moves while the ring has
+ * no room for them, and resume once userspace moves tail. Events only find
+ * the ring full if userspace corrupts tail, those are dropped and counted.
+ * poll() reports the file readable while head != tail.
+ */
+#define KXO_MMAP_EVENTS 0
+
+struct kxo_ring_header {
+    __u32 head; /* written by the kernel */
+    __u32 pad0[15];
+    __u32 tail; /* written by userspace */
+    __u32 pad1[15];
+    __u32 nr_events;
+    __u32 dropped;
+};
+
+/* Boards of the games of a session, mapped read-only at KXO_MMAP_BOARDS:
+ * an array of struct kxo_board indexed by game id, as many as the length of
+ * the first mapping holds. Games with a larger id have no snapshot.
+ *
+ * Each board is updated under its own sequence count: seq is odd while the
+ * kernel writes it. Readers load seq with acquire semantics, retry while it
+ * is odd, copy the board, then retry if seq changed meanwhile.
+ */
+#define KXO_MMAP_BOARDS 0x10000000
+
+struct kxo_board {
+    __u32 seq;
+    __u16 o, x;     /* squares of each player, bit i for square i */
+    __u16 move_nr;  /* moves played in the current game */
+    __u8 turn;      /* 'O' or 'X', 0 once the game is over */
+    __u8 result;    /* 0 while playing, else 'O', 'X' or 'D' for a draw */
+    __u32 games;    /* games finished, a new one starts after each */
+};
+
+/* flags of struct kxo_event */
+#define KXO_EVENT_WIN 0x1  /* the move won the game, the board is reset */
+#define KXO_EVENT_DRAW 0x2 /* the move drew the game, the board is reset */
+
+struct kxo_event {
+    __u64 time_ns; /* CLOCK_MONOTONIC, when the move was played */
+    __u32 game_id;
+    __u8 move;   /* square, 0xff if the player had none */
+    __u8 player; /* 'O' or 'X' */
+    __u8 flags;
+    __u8 pad;
+};
+
+/* Spectating. Any open file of the device may watch the moves of the games
+ * of another, identified by the id KXO_IOC_SESSION_ID returns there, or of
+ * all of them. Only the games of files opened by the same user are seen,
+ * unless the spectator has CAP_SYS_ADMIN. Moves of every game, AI or
+ * userspace, go to rings shared by all spectators, one per CPU, where the
+ * oldest are overwritten. Each spectator reads from its own cursors, the
+ * moves of a game in the order they were played, and is told how many moves
+ * it missed.
+ */
+#define KXO_WATCH_ANY 0xffffffffU
+
+/* Argument of KXO_IOC_WATCH, which starts watching from the next move */
+struct kxo_watch {
+    __u32 session_id; /* or KXO_WATCH_ANY */
+    __u32 game_id;    /* or KXO_WATCH_ANY */
+};
+
+struct kxo_watch_event {
+    struct kxo_event event;
+    __u32 session_id;
+    __u32 pad;
+};
+
+/* Argument of KXO_IOC_WATCH_READ, which blocks until it read a watched move.
+ * With O_NONBLOCK it fails with EAGAIN if no move was played since the last
+ * read, and may read none if those played are not watched.
+ */
+struct kxo_watch_read {
+    __u64 buf;  /* user pointer to an array of struct kxo_watch_event */
+    __u32 nr;   /* room in buf, set to the number of events read */
+    __u32 lost; /* set to the moves overwritten before they were read */
+};
+
 #define get_user_id(device_fd, user_id, player1, player2) \
     ({                                                    \
         user_id = player1 << 4 | player2;                 \
         ioctl(device_fd, GET_USER_ID, &user_id);          \
     })
 
+#define set_pace(device_fd, id, pace)                                   \
+    ({                                                                  \
+        struct kxo_pace __pace = {.user_id = (id), .pace_us = (pace)}; \
+        ioctl(device_fd, SET_PACE, &__pace);                            \
+    })
+
+#define set_qos(device_fd, id, class)                             \
+    ({                                                            \
+        struct kxo_qos __qos = {.user_id = (id), .qos = (class)}; \
+        ioctl(device_fd, SET_QOS, &__qos);                        \
+    })
+
 #endif
\ No newline at end of file
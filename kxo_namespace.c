@@ -1,151 +1,173 @@
+#include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
 
+#include "kxo_board.h"
 #include "kxo_namespace.h"
+#include "kxo_notify.h"
+#include "kxo_sched.h"
+#include "kxo_watch.h"
 
-struct kxo_namespace {
-    struct hlist_head head;
-    rwlock_t lock;
-};
-
-struct kxo_namespace kxo_namespace[NAMESPACE_MAX];
 struct lf_list user_list_head;
-struct lf_list trash_list_head;
+struct kmem_cache *user_data_cache;
+static struct kmem_cache *tid_data_cache;
+static atomic_t next_session_id;
 
+static unsigned int max_games = 65536;
+module_param(max_games, uint, 0644);
+MODULE_PARM_DESC(max_games, "Games a session may create, 0 for no limit");
 
-void init_namespace(void)
+int init_namespace(void)
 {
-    for (int i = 0; i < NAMESPACE_MAX; i++) {
-        INIT_HLIST_HEAD(&kxo_namespace[i].head);
-        rwlock_init(&kxo_namespace[i].lock);
-    }
     lf_list_init(&user_list_head);
-    lf_list_init(&trash_list_head);
+
+    /* Games and sessions are small and numerous, a page each would dwarf
+     * them. Aligned so that no two games share a cache line.
+     */
+    user_data_cache = KMEM_CACHE(user_data, SLAB_HWCACHE_ALIGN);
+    if (!user_data_cache)
+        return -ENOMEM;
+    tid_data_cache = KMEM_CACHE(tid_data, SLAB_HWCACHE_ALIGN);
+    if (!tid_data_cache) {
+        kmem_cache_destroy(user_data_cache);
+        return -ENOMEM;
+    }
+    return 0;
 }
 
-int add_tid_data(pid_t tid)
+TidData *add_tid_data(pid_t tid)
 {
-    TidData *data = vmalloc(sizeof(TidData));
+    TidData *data = kmem_cache_alloc(tid_data_cache, GFP_KERNEL);
     if (!data)
-        goto data_fail;
-    data->user_data_list = (UserData **) vmalloc(sizeof(UserData *) * USER_MAX);
-    for (int i = 0; i < USER_MAX; i++)
-        data->user_data_list[i] = NULL;
+        return NULL;
+    data->budget = kxo_budget_get();
+    if (!data->budget) {
+        kmem_cache_free(tid_data_cache, data);
+        return NULL;
+    }
+    xa_init_flags(&data->games, XA_FLAGS_ALLOC);
     init_waitqueue_head(&data->tid_wait);
-    data->user_cnt = 0;
-
-    if (!data->user_data_list)
-        goto user_list_fail;
-
+    refcount_set(&data->ref, 1);
+    data->ring = NULL;
+    data->boards = NULL;
+    data->watcher = NULL;
+    data->session_id = atomic_inc_return(&next_session_id);
+    data->uid = current_euid();
+    mutex_init(&data->read_lock);
+    data->read_cursor = 0;
+    xa_init(&data->eventfds);
+    data->eventfd = NULL;
     data->tid = tid;
-    unsigned int nid = hash_function(tid);
-    write_lock(&kxo_namespace[nid].lock);
-    hlist_add_head(&data->hlist, &kxo_namespace[nid].head);
-    write_unlock(&kxo_namespace[nid].lock);
-
-    return 0;
 
-user_list_fail:
-    vfree(data);
-data_fail:
-    return -1;
+    return data;
 }
 
-int delete_tid_data(pid_t tid)
+static void free_tid_data(TidData *data)
 {
-    TidData *data = find_tid_data(tid);
-    if (!data)
-        return -1;
-
-    unsigned int nid = hash_function(tid);
-    write_lock(&kxo_namespace[nid].lock);
-    hlist_del(&data->hlist);
-    write_unlock(&kxo_namespace[nid].lock);
-
-    for (int i = 0; i < USER_MAX; i++)
-        if (data->user_data_list[i] != NULL)
-            WRITE_ONCE(data->user_data_list[i]->unuse, 1);
-
-    return 0;
+    kxo_budget_put(data->budget);
+    xa_destroy(&data->games);
+    kxo_ring_free(data->ring);
+    kxo_board_free(data->boards);
+    kxo_notify_release(data);
+    kxo_watch_release(data);
+    kmem_cache_free(tid_data_cache, data);
 }
 
-TidData *find_tid_data(pid_t tid)
+static void put_tid_data(TidData *data)
 {
-    unsigned int nid = hash_function(tid);
-    TidData *pos = NULL;
-    read_lock(&kxo_namespace[nid].lock);
-    hlist_for_each_entry(pos, &kxo_namespace[nid].head, hlist) {
-        if (pos->tid == tid)
-            break;
-    }
-    read_unlock(&kxo_namespace[nid].lock);
+    if (refcount_dec_and_test(&data->ref))
+        free_tid_data(data);
+}
 
-    return pos;
+void delete_tid_data(TidData *data)
+{
+    UserData *user_data;
+    unsigned long id;
+
+    /* The reaper may free the games as soon as they are retired, the
+     * session lives on until the last of them and this reference are gone
+     */
+    xa_for_each(&data->games, id, user_data)
+        WRITE_ONCE(user_data->unuse, 1);
+    put_tid_data(data);
 }
 
-int add_user(pid_t tid, ai_func_t ai1_func, ai_func_t ai2_func)
+int add_user(TidData *tid_data,
+             ai_func_t ai1_func,
+             ai_func_t ai2_func,
+             u32 max_id,
+             u32 *id)
 {
-    TidData *tid_data = find_tid_data(tid);
     UserData *user_data = init_user_data(ai1_func, ai2_func, tid_data);
     pr_info("kxo: real user_data: %p\n", user_data);
     if (!user_data)
-        return -1;
-    for (int i = 0; i < USER_MAX; i++) {
-        if (cmpxchg((tid_data->user_data_list + i), NULL, user_data) == NULL) {
-            lf_list_add_head(&user_list_head, &user_data->hlist);
-            tid_data->user_cnt++;
-            return i;
-        }
-    }
-    release_user_data(&user_data);
+        return -ENOMEM;
 
-    return -1;
+    u32 limit = min(max_id, READ_ONCE(max_games) - 1);
+    int ret = xa_alloc(&tid_data->games, &user_data->id, user_data,
+                       XA_LIMIT(0, limit), GFP_KERNEL);
+    if (ret) {
+        release_user_data(&user_data);
+        return ret == -EBUSY ? -ENOSPC : ret;
+    }
+    refcount_inc(&tid_data->ref);
+    lf_list_add_head(&user_list_head, &user_data->hlist);
+    kxo_sched_game_ready(user_data);
+    *id = user_data->id;
+    return 0;
 }
 
-UserData *get_user_data(pid_t tid, int user_id)
+UserData *get_user_data(TidData *tid_data, u32 user_id)
 {
-    TidData *tid_data = find_tid_data(tid);
-    if (user_id > USER_MAX)
-        return NULL;
-    UserData *user_data = tid_data->user_data_list[user_id];
-
-    return user_data;
+    return xa_load(&tid_data->games, user_id);
 }
 
-void user_list_queue_work(struct workqueue_struct *wq)
+void user_list_reap(void)
 {
     struct lf_list *now = NULL, *nxt = NULL, *last = &user_list_head;
+    struct lf_list retired;
+
+    lf_list_init(&retired);
     lf_list_for_each_safe(now, nxt, &user_list_head)
     {
         UserData *user_data = container_of(now, UserData, hlist);
         if (!READ_ONCE(user_data->unuse)) {
-            if (get_turn_function(user_data))
-                queue_work(wq, &user_data->work);
             last = now;
-        } else {
-            lf_list_remove(last, now, &user_list_head);
-            lf_list_add_head(&trash_list_head, now);
-            user_data->tid_data->user_cnt--;
-            if (user_data->tid_data->user_cnt == 0)
-                vfree(user_data->tid_data);
+            continue;
         }
+        kxo_sched_cancel(user_data);
+        lf_list_remove(last, now, &user_list_head);
+        lf_list_add_head(&retired, now);
     }
-}
+    if (!retired.next)
+        return;
 
-void release_namespace(void)
-{
-    struct lf_list *now = NULL, *nxt = NULL, *last = &user_list_head;
-    lf_list_for_each_safe(now, nxt, &user_list_head)
+    /* Out of every queue, but a worker may still be playing or pondering on
+     * them, one grace period for the whole lot
+     */
+    kxo_sched_synchronize();
+
+    lf_list_for_each_safe(now, nxt, &retired)
     {
         UserData *user_data = container_of(now, UserData, hlist);
-        lf_list_remove(last, now, &user_list_head);
+        TidData *tid_data = user_data->tid_data;
         release_user_data(&user_data);
-        last = now;
+        put_tid_data(tid_data);
     }
-    lf_list_for_each_safe(now, nxt, &trash_list_head)
+}
+
+void release_namespace(void)
+{
+    struct lf_list *now = NULL, *nxt = NULL;
+
+    /* Every session is closed by now */
+    user_list_reap();
+    lf_list_for_each_safe(now, nxt, &user_list_head)
     {
         UserData *user_data = container_of(now, UserData, hlist);
-        lf_list_remove(last, now, &trash_list_head);
+        lf_list_remove(&user_list_head, now, &user_list_head);
         release_user_data(&user_data);
-        last = now;
     }
-}
\ No newline at end of file
+    kmem_cache_destroy(tid_data_cache);
+    kmem_cache_destroy(user_data_cache);
+}
@@ -6,52 +6,55 @@
 #include "type.h"
 #include "user_data.h"
 
-#define NAMESPACE_MAX 256
-#define USER_MAX 32
+/* Marks the games of a session with unread moves */
+#define KXO_GAME_READABLE XA_MARK_1
+/* Marks the games that played since the last KXO_IOC_FETCH_READY */
+#define KXO_GAME_NOTIFIED XA_MARK_2
 
-static unsigned int hash_function(pid_t input)
-{
-    return input % NAMESPACE_MAX;
-}
-
-void init_namespace(void);
+// returns 0 or -ENOMEM
+int init_namespace(void);
 
 /**
- * add_tid_data - Create a TidData object and insert it into the kxo_namespace
- * hash table.
+ * add_tid_data - Create the session of an open file of the device.
  *
- * @tid: The thread ID of the currently operating thread.
+ * @tid: The thread ID of the thread opening it, for the logs.
  *
- * Return:
- *  0  - Object creation succeeded.
- * -1  - Object creation failed.
+ * Return: The session, to keep in file->private_data, or NULL if out of
+ * memory.
  */
-int add_tid_data(pid_t tid);
+TidData *add_tid_data(pid_t tid);
 
 /**
- * delete_tid_data - Delete a TidData from the kxo_namespace hash table.
- *
- * @tid: The thread ID of the currently operating thread.
+ * delete_tid_data - Close a session. Its games are retired, then freed by
+ * user_list_reap(), which frees the session along with the last of them.
  *
- * Return:
- *  0  - Object creation succeeded.
- * -1  - Object creation failed.
+ * @data: The session of the file being released.
  */
-int delete_tid_data(pid_t tid);
-
-// find TidData by tid
-TidData *find_tid_data(pid_t tid);
-
-// use when a thread need a new user
-int add_user(pid_t tid, ai_func_t ai1_func, ai_func_t ai2_func);
+void delete_tid_data(TidData *data);
 
-// remove user by id
-void remove_user(pid_t tid, int user_id);
+/**
+ * add_user - Create a game in a session.
+ *
+ * @tid_data: The session.
+ * @ai1_func: Engine of 'O', NULL if played from userspace.
+ * @ai2_func: Engine of 'X', NULL if played from userspace.
+ * @max_id: Largest id the caller can represent.
+ * @id: Set to the id of the game.
+ *
+ * Return: 0, -ENOSPC if the session has no id left, -ENOMEM.
+ */
+int add_user(TidData *tid_data,
+             ai_func_t ai1_func,
+             ai_func_t ai2_func,
+             u32 max_id,
+             u32 *id);
 
-void user_list_queue_work(struct workqueue_struct *wq);
+// retire the games of closed sessions
+void user_list_reap(void);
 
-UserData *get_user_data(pid_t tid, int user_id);
+// game of the session by id, NULL if there is none
+UserData *get_user_data(TidData *tid_data, u32 user_id);
 
-// only use when rmmod
+// only use when rmmod, frees the games and their caches
 void release_namespace(void);
 #endif
\ No newline at end of file
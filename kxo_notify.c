@@ -0,0 +1,181 @@
+#include <linux/bitops.h>
+#include <linux/device.h>
+#include <linux/eventfd.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+
+#include "kxo_namespace.h"
+#include "kxo_notify.h"
+#include "kxo_sched.h"
+
+/* Words of the ready bitmap filled at a time */
+#define KXO_READY_CHUNK 16
+
+static atomic64_t events, wakeups, signals;
+
+static void kxo_notify_signal(struct eventfd_ctx *ctx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(ctx);
+#else
+    eventfd_signal(ctx, 1);
+#endif
+    atomic64_inc(&signals);
+}
+
+void kxo_notify(UserData *user_data)
+{
+    TidData *tid_data = user_data->tid_data;
+    struct eventfd_ctx *ctx;
+
+    atomic64_inc(&events);
+    xa_set_mark(&tid_data->games, user_data->id, KXO_GAME_NOTIFIED);
+
+    /* Put only after a grace period, see kxo_notify_set_eventfd() */
+    ctx = xa_load(&tid_data->eventfds, user_data->id);
+    if (ctx)
+        kxo_notify_signal(ctx);
+    ctx = READ_ONCE(tid_data->eventfd);
+    if (ctx)
+        kxo_notify_signal(ctx);
+
+    /* Most moves find nobody asleep, skip the waitqueue lock for those */
+    if (wq_has_sleeper(&tid_data->tid_wait)) {
+        wake_up_interruptible(&tid_data->tid_wait);
+        atomic64_inc(&wakeups);
+    }
+}
+
+int kxo_notify_fetch_ready(TidData *tid_data,
+                           u64 __user *buf,
+                           u32 first,
+                           u32 nr_words)
+{
+    u64 words[KXO_READY_CHUNK];
+    int ready = 0;
+
+    if (first % BITS_PER_TYPE(u64))
+        return -EINVAL;
+
+    for (u32 w = 0; w < nr_words; w += KXO_READY_CHUNK) {
+        u32 n = min_t(u32, nr_words - w, KXO_READY_CHUNK);
+        unsigned long base = first + (unsigned long) w * BITS_PER_TYPE(u64);
+        unsigned long id = base;
+        unsigned long last = base + n * BITS_PER_TYPE(u64) - 1;
+        UserData *user_data;
+
+        memset(words, 0, sizeof(words));
+        /* A move after the mark is cleared marks the game again */
+        for (user_data = xa_find(&tid_data->games, &id, last,
+                                 KXO_GAME_NOTIFIED);
+             user_data; user_data = xa_find_after(&tid_data->games, &id,
+                                                  last, KXO_GAME_NOTIFIED)) {
+            xa_clear_mark(&tid_data->games, id, KXO_GAME_NOTIFIED);
+            words[(id - base) / BITS_PER_TYPE(u64)] |=
+                1ULL << (id % BITS_PER_TYPE(u64));
+            ready++;
+        }
+        if (copy_to_user(buf + w, words, n * sizeof(u64)))
+            return -EFAULT;
+    }
+    return ready;
+}
+
+int kxo_notify_set_eventfd(TidData *tid_data,
+                           bool session,
+                           u32 game_id,
+                           int fd)
+{
+    struct eventfd_ctx *ctx = NULL, *old;
+    int ret = 0;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    if (session) {
+        old = xchg(&tid_data->eventfd, ctx);
+    } else if (!get_user_data(tid_data, game_id)) {
+        ret = -EINVAL;
+        old = ctx;
+    } else {
+        old = ctx ? xa_store(&tid_data->eventfds, game_id, ctx, GFP_KERNEL)
+                  : xa_erase(&tid_data->eventfds, game_id);
+        if (xa_is_err(old)) {
+            ret = xa_err(old);
+            old = ctx;
+        }
+    }
+
+    /* Workers signal the eventfd they loaded under the scheduler's SRCU */
+    if (old) {
+        if (old != ctx)
+            kxo_sched_synchronize();
+        eventfd_ctx_put(old);
+    }
+    return ret;
+}
+
+void kxo_notify_release(TidData *tid_data)
+{
+    struct eventfd_ctx *ctx;
+    unsigned long id;
+
+    xa_for_each(&tid_data->eventfds, id, ctx)
+        eventfd_ctx_put(ctx);
+    xa_destroy(&tid_data->eventfds);
+    if (tid_data->eventfd)
+        eventfd_ctx_put(tid_data->eventfd);
+}
+
+static ssize_t events_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&events));
+}
+static DEVICE_ATTR_RO(events);
+
+static ssize_t wakeups_show(struct device *dev,
+                            struct device_attribute *attr,
+                            char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&wakeups));
+}
+static DEVICE_ATTR_RO(wakeups);
+
+static ssize_t eventfd_signals_show(struct device *dev,
+                                    struct device_attribute *attr,
+                                    char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&signals));
+}
+static DEVICE_ATTR_RO(eventfd_signals);
+
+/* Waitqueue wakeups and eventfd signals per move, in thousandths */
+static ssize_t wakeups_per_kevent_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf)
+{
+    s64 n = atomic64_read(&events);
+    s64 woken = atomic64_read(&wakeups) + atomic64_read(&signals);
+
+    return sysfs_emit(buf, "%lld\n", n ? div64_s64(woken * 1000, n) : 0);
+}
+static DEVICE_ATTR_RO(wakeups_per_kevent);
+
+static struct attribute *kxo_notify_attrs[] = {
+    &dev_attr_events.attr,
+    &dev_attr_wakeups.attr,
+    &dev_attr_eventfd_signals.attr,
+    &dev_attr_wakeups_per_kevent.attr,
+    NULL,
+};
+
+const struct attribute_group kxo_notify_group = {
+    .name = "notify",
+    .attrs = kxo_notify_attrs,
+};
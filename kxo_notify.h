@@ -0,0 +1,58 @@
+#ifndef KXO_NOTIFY_H
+#define KXO_NOTIFY_H
+
+#include <linux/sysfs.h>
+
+#include "type.h"
+
+/* Notification statistics, a "notify" directory of the device */
+extern const struct attribute_group kxo_notify_group;
+
+/**
+ * kxo_notify - Tell the session of a game that it played a move.
+ *
+ * @user_data: The game, whose move is in its fifo or the event ring.
+ *
+ * Marks the game ready for KXO_IOC_FETCH_READY, signals the eventfds
+ * registered for the game and for the session, and wakes up the threads
+ * sleeping on the session, if any. Called by a worker, within the read side
+ * of the scheduler's SRCU.
+ */
+void kxo_notify(UserData *user_data);
+
+/**
+ * kxo_notify_fetch_ready - Fetch and clear the ready marks of a range of
+ * games.
+ *
+ * @tid_data: The session.
+ * @buf: Bitmap to fill, bit i of word w for game first + 64 * w + i.
+ * @first: Id of the first game of the range, a multiple of 64.
+ * @nr_words: Length of buf.
+ *
+ * Return: The number of games ready, or -errno.
+ */
+int kxo_notify_fetch_ready(TidData *tid_data,
+                           u64 __user *buf,
+                           u32 first,
+                           u32 nr_words);
+
+/**
+ * kxo_notify_set_eventfd - Register the eventfd signalled on the moves of a
+ * game, or of all the games of a session.
+ *
+ * @tid_data: The session.
+ * @session: Whether for all the games of the session.
+ * @game_id: The game otherwise.
+ * @fd: The eventfd, or -1 to unregister the current one.
+ *
+ * Return: 0, or -errno.
+ */
+int kxo_notify_set_eventfd(TidData *tid_data,
+                           bool session,
+                           u32 game_id,
+                           int fd);
+
+// drop the eventfds of a session being freed
+void kxo_notify_release(TidData *tid_data);
+
+#endif
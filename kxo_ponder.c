@@ -0,0 +1,161 @@
+#include <linux/device.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+
+#include "game.h"
+#include "kxo_ponder.h"
+#include "kxo_sched.h"
+#include "negamax.h"
+
+static bool ponder;
+module_param(ponder, bool, 0644);
+MODULE_PARM_DESC(ponder,
+                 "Search the replies to a human's likely moves while the "
+                 "human is thinking");
+
+static atomic64_t hits, misses, searches;
+
+void kxo_ponder_start(UserData *user_data)
+{
+    struct kxo_ponder *p = &user_data->ponder;
+    char human = user_data->turn;
+
+    p->n_moves = 0;
+    p->next = 0;
+    p->searching = false;
+    p->player = human ^ 'O' ^ 'X';
+    if (!READ_ONCE(ponder) ||
+        !(p->player == 'O' ? user_data->ai1_func : user_data->ai2_func))
+        return;
+
+    memcpy(p->table, user_data->table, N_GRIDS);
+    memset(p->reply, -1, sizeof(p->reply));
+
+    /* The reply negamax expected to its own move comes first */
+    negamax_context_t *ctx = user_data->negamax_ctx;
+    int expected = -1;
+    if (ctx && ctx->prev_pv_length > 1 && p->table[ctx->prev_pv[1]] == ' ') {
+        expected = ctx->prev_pv[1];
+        p->order[p->n_moves++] = expected;
+    }
+    for (int i = 0; i < N_GRIDS; i++)
+        if (p->table[i] == ' ' && i != expected)
+            p->order[p->n_moves++] = i;
+
+    if (p->n_moves)
+        kxo_sched_ponder(user_data);
+}
+
+int kxo_ponder_lookup(UserData *user_data)
+{
+    struct kxo_ponder *p = &user_data->ponder;
+    int human_move = -1, move = -1;
+
+    if (!p->n_moves || p->player != user_data->turn)
+        goto out;
+
+    /* The position pondered on, plus one move of the human */
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (p->table[i] == user_data->table[i])
+            continue;
+        if (p->table[i] != ' ' || human_move >= 0)
+            goto miss;
+        human_move = i;
+    }
+    if (human_move < 0)
+        goto miss;
+
+    move = p->reply[human_move];
+    if (move < 0 || user_data->table[move] != ' ') {
+        move = -1;
+        goto miss;
+    }
+    atomic64_inc(&hits);
+    goto out;
+
+miss:
+    atomic64_inc(&misses);
+out:
+    p->n_moves = 0;
+    p->searching = false;
+    return move;
+}
+
+bool kxo_ponder_step(UserData *user_data, ktime_t deadline, ktime_t slice_end)
+{
+    struct kxo_ponder *p = &user_data->ponder;
+    bool more = false;
+
+    /* Busy playing, or pondered by another worker: try again later, a
+     * real move stops the pondering by itself
+     */
+    if (!mutex_trylock(&user_data->search_lock))
+        return true;
+
+    /* Stop once the human moved */
+    if (READ_ONCE(user_data->unuse) || p->next >= p->n_moves ||
+        memcmp(p->table, user_data->table, N_GRIDS))
+        goto out;
+
+    char table[N_GRIDS];
+    int human_move = p->order[p->next];
+    memcpy(table, p->table, N_GRIDS);
+    table[human_move] = p->player ^ 'O' ^ 'X';
+
+    if (check_win(table) == ' ') {
+        ai_func_t ai_func =
+            p->player == 'O' ? user_data->ai1_func : user_data->ai2_func;
+        if (!p->searching)
+            p->deadline = deadline;
+        int move = ai_func(user_data, table, p->player, p->deadline,
+                           slice_end, true);
+        p->searching = move == SEARCH_YIELD;
+        if (p->searching) {
+            more = true;
+            goto out;
+        }
+        p->reply[human_move] = move;
+        atomic64_inc(&searches);
+    }
+    more = ++p->next < p->n_moves;
+
+out:
+    mutex_unlock(&user_data->search_lock);
+    return more;
+}
+
+static ssize_t hits_show(struct device *dev,
+                         struct device_attribute *attr,
+                         char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&hits));
+}
+static DEVICE_ATTR_RO(hits);
+
+static ssize_t misses_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&misses));
+}
+static DEVICE_ATTR_RO(misses);
+
+static ssize_t searches_show(struct device *dev,
+                             struct device_attribute *attr,
+                             char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&searches));
+}
+static DEVICE_ATTR_RO(searches);
+
+static struct attribute *kxo_ponder_attrs[] = {
+    &dev_attr_hits.attr,
+    &dev_attr_misses.attr,
+    &dev_attr_searches.attr,
+    NULL,
+};
+
+const struct attribute_group kxo_ponder_group = {
+    .name = "ponder",
+    .attrs = kxo_ponder_attrs,
+};
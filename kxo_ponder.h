@@ -0,0 +1,43 @@
+#ifndef KXO_PONDER_H
+#define KXO_PONDER_H
+
+#include <linux/ktime.h>
+#include <linux/sysfs.h>
+
+#include "type.h"
+
+/* Pondering statistics, a "ponder" directory of the device */
+extern const struct attribute_group kxo_ponder_group;
+
+/**
+ * kxo_ponder_start - Start searching the AI replies to the moves a human may
+ * play next, if pondering is enabled.
+ *
+ * @user_data: A game where a human is to move against the AI. Its
+ * search_lock must be held.
+ */
+void kxo_ponder_start(UserData *user_data);
+
+/**
+ * kxo_ponder_lookup - Reply found while the human was thinking.
+ *
+ * @user_data: The game, with its search_lock held, after the human moved.
+ *
+ * Return: The move to play, or -1 if it has to be searched. The replies to
+ * the other human moves are dropped either way.
+ */
+int kxo_ponder_lookup(UserData *user_data);
+
+/**
+ * kxo_ponder_step - Search the reply to one more human move.
+ *
+ * @user_data: The game. Takes its search_lock, leaves the step for later if
+ * it is busy.
+ * @deadline: When the search has to be done, unless it is resumed.
+ * @slice_end: When to suspend the search.
+ *
+ * Return: Whether replies to this or other human moves remain to be searched.
+ */
+bool kxo_ponder_step(UserData *user_data, ktime_t deadline, ktime_t slice_end);
+
+#endif
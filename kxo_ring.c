@@ -0,0 +1,139 @@
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/vmalloc.h>
+
+#include "kxo_ring.h"
+
+/* 16 MiB of events */
+#define KXO_RING_MAX_EVENTS (1U << 20)
+
+static struct kxo_ring *kxo_ring_alloc(size_t size)
+{
+    size_t nr_events = (size - PAGE_SIZE) / sizeof(struct kxo_event);
+
+    if (size <= PAGE_SIZE || !is_power_of_2(nr_events) ||
+        nr_events > KXO_RING_MAX_EVENTS)
+        return ERR_PTR(-EINVAL);
+
+    struct kxo_ring *ring = kmalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return ERR_PTR(-ENOMEM);
+    /* Zeroed, and mappable to userspace */
+    ring->hdr = vmalloc_user(size);
+    if (!ring->hdr) {
+        kfree(ring);
+        return ERR_PTR(-ENOMEM);
+    }
+    spin_lock_init(&ring->lock);
+    ring->head = 0;
+    ring->mask = nr_events - 1;
+    atomic_set(&ring->reserved, 0);
+    ring->hdr->nr_events = nr_events;
+    ring->events = (void *) ring->hdr + PAGE_SIZE;
+    return ring;
+}
+
+void kxo_event_init(struct kxo_event *event,
+                    u32 game_id,
+                    int move,
+                    char player,
+                    char win)
+{
+    event->time_ns = ktime_get_ns();
+    event->game_id = game_id;
+    event->move = move < 0 ? 0xff : move;
+    event->player = player;
+    event->flags = win == 'D'   ? KXO_EVENT_DRAW
+                   : win != ' ' ? KXO_EVENT_WIN
+                                : 0;
+    event->pad = 0;
+}
+
+int kxo_ring_mmap(struct kxo_ring **ring, struct vm_area_struct *vma)
+{
+    size_t size = vma->vm_end - vma->vm_start;
+
+    /* Userspace writes tail, a private copy would never be seen */
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    struct kxo_ring *r = READ_ONCE(*ring);
+    if (!r) {
+        r = kxo_ring_alloc(size);
+        if (IS_ERR(r))
+            return PTR_ERR(r);
+        /* Mapped by another thread meanwhile */
+        struct kxo_ring *old = cmpxchg(ring, NULL, r);
+        if (old) {
+            kxo_ring_free(r);
+            r = old;
+        }
+    }
+
+    if (size != PAGE_SIZE + (r->mask + 1) * sizeof(struct kxo_event))
+        return -EBUSY;
+    return remap_vmalloc_range(vma, r->hdr, 0);
+}
+
+bool kxo_ring_reserve(struct kxo_ring *ring)
+{
+    if (!ring)
+        return true;
+
+    int reserved = atomic_read(&ring->reserved);
+    do {
+        u32 used = READ_ONCE(ring->head) - smp_load_acquire(&ring->hdr->tail);
+        if (used + reserved > ring->mask)
+            return false;
+    } while (!atomic_try_cmpxchg(&ring->reserved, &reserved, reserved + 1));
+    return true;
+}
+
+void kxo_ring_unreserve(struct kxo_ring *ring)
+{
+    if (ring)
+        atomic_dec(&ring->reserved);
+}
+
+bool kxo_ring_push(struct kxo_ring *ring,
+                   u32 game_id,
+                   int move,
+                   char player,
+                   char win)
+{
+    if (!ring)
+        return false;
+
+    spin_lock(&ring->lock);
+    u32 head = ring->head;
+    /* Pairs with the release of tail by userspace, done with the event.
+     * Moves have a slot kept, only a tail userspace scribbled on gets here.
+     */
+    if (head - smp_load_acquire(&ring->hdr->tail) > ring->mask) {
+        WRITE_ONCE(ring->hdr->dropped, ring->hdr->dropped + 1);
+        goto out;
+    }
+
+    kxo_event_init(&ring->events[head & ring->mask], game_id, move, player,
+                   win);
+    ring->head = head + 1;
+    smp_store_release(&ring->hdr->head, ring->head);
+
+out:
+    spin_unlock(&ring->lock);
+    return true;
+}
+
+bool kxo_ring_readable(struct kxo_ring *ring)
+{
+    return ring && READ_ONCE(ring->head) != READ_ONCE(ring->hdr->tail);
+}
+
+void kxo_ring_free(struct kxo_ring *ring)
+{
+    if (!ring)
+        return;
+    vfree(ring->hdr);
+    kfree(ring);
+}
@@ -0,0 +1,79 @@
+#ifndef KXO_RING_H
+#define KXO_RING_H
+
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+
+#include "kxo_ioctl.h"
+
+/* Event ring of a session, see KXO_MMAP_EVENTS. Its header and head are
+ * shared with userspace, which may scribble on them, so the kernel keeps its
+ * own head and size.
+ */
+struct kxo_ring {
+    spinlock_t lock;  // serializes the workers playing the games
+    u32 head;
+    u32 mask;           // nr_events - 1
+    atomic_t reserved;  // slots kept for the moves being computed
+    struct kxo_ring_header *hdr;
+    struct kxo_event *events;  // right after the header page
+};
+
+// fill in the event of a move played now, win being check_win() after it
+void kxo_event_init(struct kxo_event *event,
+                    u32 game_id,
+                    int move,
+                    char player,
+                    char win);
+
+/**
+ * kxo_ring_mmap - Map the event ring of a session, creating it on the first
+ * call.
+ *
+ * @ring: Where the session keeps its ring.
+ * @vma: A shared mapping at KXO_MMAP_EVENTS, one page for the header then a
+ * power of two of events.
+ *
+ * Return: 0, -EINVAL for a mapping of the wrong kind or size, -EBUSY if the
+ * ring exists with another size, -ENOMEM.
+ */
+int kxo_ring_mmap(struct kxo_ring **ring, struct vm_area_struct *vma);
+
+/**
+ * kxo_ring_reserve - Keep a slot for the move about to be computed, so that
+ * it is not computed only to find the ring full.
+ *
+ * @ring: The ring, or NULL if the session has none.
+ *
+ * Return: false if the events unread and the slots already kept fill the
+ * ring. Otherwise release the slot with kxo_ring_unreserve() once the move
+ * is pushed, or given up.
+ */
+bool kxo_ring_reserve(struct kxo_ring *ring);
+void kxo_ring_unreserve(struct kxo_ring *ring);
+
+/**
+ * kxo_ring_push - Publish a move to the ring of its session.
+ *
+ * @ring: The ring, or NULL if the session has none.
+ * @game_id: The game.
+ * @move: The square played, -1 if none.
+ * @player: Who played it.
+ * @win: check_win() after the move.
+ *
+ * Return: false if there is no ring, the move has to be queued to the fifo
+ * of the game.
+ */
+bool kxo_ring_push(struct kxo_ring *ring,
+                   u32 game_id,
+                   int move,
+                   char player,
+                   char win);
+
+// whether userspace has events left to consume
+bool kxo_ring_readable(struct kxo_ring *ring);
+
+// once nothing is mapped nor pushes any more
+void kxo_ring_free(struct kxo_ring *ring);
+
+#endif
@@ -0,0 +1,1167 @@
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/sysfs.h>
+#include <linux/timerqueue.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "kxo_ioctl.h"
+#include "kxo_namespace.h"
+#include "kxo_ponder.h"
+#include "kxo_sched.h"
+#include "user_data.h"
+
+/* Paced moves due within this much of each other share one wakeup */
+#define KXO_PACE_SLACK_NS (50 * NSEC_PER_USEC)
+
+/* Most games a worker takes off a run queue at once */
+#define KXO_BATCH 16
+
+/* Shortest search a move gets, even past its deadline */
+#define KXO_MIN_SEARCH_NS NSEC_PER_MSEC
+
+/* How often a game whose event ring is full looks for room again, userspace
+ * consuming events does not tell the kernel
+ */
+#define KXO_RING_RETRY_NS NSEC_PER_MSEC
+
+static unsigned int default_pace_us = 100000;
+module_param(default_pace_us, uint, 0644);
+MODULE_PARM_DESC(default_pace_us,
+                 "Time (in usec) between two moves of a new AI-vs-AI game");
+
+static bool unthrottled;
+module_param(unthrottled, bool, 0644);
+MODULE_PARM_DESC(unthrottled,
+                 "Let AI-vs-AI games move as soon as the previous move is "
+                 "done, regardless of their pace");
+
+static unsigned int reply_deadline_us = 50000;
+module_param(reply_deadline_us, uint, 0644);
+MODULE_PARM_DESC(reply_deadline_us,
+                 "Time (in usec) the AI may take to reply to a human, or to "
+                 "play a move of an unpaced game");
+
+static unsigned int fifo_high_wm = 24;
+module_param(fifo_high_wm, uint, 0644);
+MODULE_PARM_DESC(fifo_high_wm,
+                 "Unread moves at which a game stops computing moves, also "
+                 "sizes the fifo of new games");
+
+static unsigned int fifo_low_wm = 8;
+module_param(fifo_low_wm, uint, 0644);
+MODULE_PARM_DESC(fifo_low_wm,
+                 "Unread moves under which a stopped game resumes");
+
+static unsigned int search_slice_us = 2000;
+module_param(search_slice_us, uint, 0644);
+MODULE_PARM_DESC(search_slice_us,
+                 "Time (in usec) a search runs before yielding to the moves "
+                 "queued behind it (0 to search each move at once)");
+
+static char *worker_cpus;
+module_param(worker_cpus, charp, 0444);
+MODULE_PARM_DESC(worker_cpus,
+                 "CPUs (e.g. \"2-5,7\") running AI moves, all online CPUs "
+                 "if unset");
+
+/* Queue latency histogram: 4 buckets per power of two of nanoseconds, up
+ * to 2^40 ns (about 18 minutes).
+ */
+#define KXO_LAT_BUCKETS 160
+
+/* The games of one QoS class on one CPU, earliest deadline first, and the
+ * worker playing them
+ */
+struct kxo_runq {
+    struct kxo_rq *rq;
+    int qos;
+    struct timerqueue_head tree;
+    unsigned int nr_running;  // games in tree
+
+    struct task_struct *worker;
+    struct wait_queue_head wait;
+    bool busy;    // the worker is playing moves
+    bool kicked;  // woken up to steal from a busy peer
+
+    /* Written by the worker only */
+    u64 moves;
+    u64 batches;
+    u64 steals;
+    u64 yields;    // searches suspended at the end of a slice
+    u64 move_ns;   // time spent computing moves
+    u64 busy_ns;   // time spent handling batches, moves included
+    u64 queue_ns;  // time games waited in tree
+    u64 missed;    // moves done past their deadline
+    u64 late_ns;   // by how much, in total
+    u32 latency[KXO_LAT_BUCKETS];
+};
+
+/* Per-CPU run queue of the games homed on that CPU. Paced moves wait on the
+ * timerqueue, ordered by due time. The hrtimer is armed for the earliest one
+ * only, so that an idle CPU takes no interrupts, and a wakeup only touches
+ * the games whose move is due. It fires on the CPU that last armed it, not
+ * necessarily the home CPU, and only moves the games it releases to the run
+ * queue of their QoS class, where they wait for the worker of that class, or
+ * for an idle peer to steal them.
+ */
+struct kxo_rq {
+    spinlock_t lock;
+    struct timerqueue_head queue;
+    struct hrtimer timer;
+    atomic_t nr_games;  // games homed on this CPU
+    int cpu;
+
+    struct kxo_runq runqs[NR_KXO_QOS];
+
+    /* Games pondering, searched by the background worker when idle */
+    struct list_head ponder_list;
+};
+
+static DEFINE_PER_CPU(struct kxo_rq, kxo_rqs);
+
+/* CPUs with worker threads, games are only homed there */
+static struct cpumask worker_mask;
+static struct cpumask idle_mask[NR_KXO_QOS];
+
+static struct work_struct reap_work;
+static bool stopping;
+
+/* Workers hold a read lock from the moment they take games off a queue until
+ * they are done with them, the reaper waits for them before freeing.
+ */
+DEFINE_STATIC_SRCU(kxo_srcu);
+
+/* Games parked because nobody reads their moves */
+static atomic_t nr_parked;
+static atomic64_t parked_ns, avoided_moves;
+/* Moves held back because the event ring of their session was full */
+static atomic64_t ring_full;
+/* Moves of closed games dropped from a run queue or aborted mid-search */
+static atomic64_t cancelled;
+
+static void kxo_rq_arm(struct kxo_rq *rq)
+{
+    struct timerqueue_node *next = timerqueue_getnext(&rq->queue);
+    if (next)
+        hrtimer_start_range_ns(&rq->timer, next->expires, KXO_PACE_SLACK_NS,
+                               HRTIMER_MODE_ABS_SOFT);
+}
+
+static struct kxo_runq *kxo_runq_of(UserData *user_data)
+{
+    struct kxo_rq *rq = per_cpu_ptr(&kxo_rqs, user_data->cpu);
+    return &rq->runqs[READ_ONCE(user_data->qos)];
+}
+
+/* A paced move is due one pace after it is released, other moves are
+ * replies expected within reply_deadline_us.
+ */
+static ktime_t kxo_sched_deadline(UserData *user_data, ktime_t release)
+{
+    u64 pace_ns = (u64) READ_ONCE(user_data->pace_us) * NSEC_PER_USEC;
+
+    if (pace_ns && !READ_ONCE(unthrottled) && user_data->ai1_func &&
+        user_data->ai2_func)
+        return ktime_add_ns(release, pace_ns);
+    return ktime_add_us(release, READ_ONCE(reply_deadline_us));
+}
+
+static ktime_t kxo_sched_slice_end(ktime_t now)
+{
+    unsigned int slice_us = READ_ONCE(search_slice_us);
+
+    return slice_us ? ktime_add_us(now, slice_us) : KTIME_MAX;
+}
+
+/* Called with rq->lock held. Return whether the worker has to be woken up.
+ * A retired game is never queued again once kxo_sched_cancel() took the lock.
+ */
+static bool kxo_runq_enqueue(struct kxo_runq *runq,
+                             UserData *user_data,
+                             ktime_t release)
+{
+    if (READ_ONCE(user_data->unuse) || atomic_xchg(&user_data->queued, 1))
+        return false;
+    user_data->runnable_at = ktime_get();
+    user_data->run_node.expires = kxo_sched_deadline(user_data, release);
+    timerqueue_add(&runq->tree, &user_data->run_node);
+    user_data->runq = runq;
+    return runq->nr_running++ == 0 || runq->busy;
+}
+
+/* Put a search that yielded back on its home run queue, behind the earlier
+ * deadlines, where an idle peer may also steal it and resume it on another
+ * CPU.
+ */
+static void kxo_runq_requeue(UserData *user_data)
+{
+    struct kxo_runq *runq = kxo_runq_of(user_data);
+
+    spin_lock_bh(&runq->rq->lock);
+    if (!READ_ONCE(user_data->unuse) && !atomic_xchg(&user_data->queued, 1)) {
+        user_data->runnable_at = ktime_get();
+        timerqueue_add(&runq->tree, &user_data->run_node);
+        user_data->runq = runq;
+        runq->nr_running++;
+    }
+    spin_unlock_bh(&runq->rq->lock);
+}
+
+static void kxo_runq_wake(struct kxo_runq *runq)
+{
+    wake_up(&runq->wait);
+
+    /* Let an idle peer steal from the busy worker */
+    if (READ_ONCE(runq->busy)) {
+        int cpu = cpumask_any_but(&idle_mask[runq->qos], runq->rq->cpu);
+        if (cpu < nr_cpu_ids) {
+            struct kxo_runq *peer =
+                &per_cpu_ptr(&kxo_rqs, cpu)->runqs[runq->qos];
+            WRITE_ONCE(peer->kicked, true);
+            wake_up(&peer->wait);
+        }
+    }
+}
+
+/* Make the move of a game runnable on its home CPU */
+static void kxo_sched_dispatch(UserData *user_data)
+{
+    struct kxo_runq *runq = kxo_runq_of(user_data);
+    bool wake;
+
+    spin_lock_bh(&runq->rq->lock);
+    wake = kxo_runq_enqueue(runq, user_data, ktime_get());
+    spin_unlock_bh(&runq->rq->lock);
+
+    if (wake)
+        kxo_runq_wake(runq);
+}
+
+/* Runs in softirq context. Make every game of the run queue whose move is
+ * due runnable, then re-arm for the next one.
+ */
+static enum hrtimer_restart kxo_rq_timer_func(struct hrtimer *timer)
+{
+    struct kxo_rq *rq = container_of(timer, struct kxo_rq, timer);
+    ktime_t tv_start, tv_end;
+    s64 nsecs;
+    int batch = 0;
+    bool wake[NR_KXO_QOS] = {false};
+
+    WARN_ON_ONCE(!in_softirq());
+
+    tv_start = ktime_get();
+
+    spin_lock(&rq->lock);
+    ktime_t horizon = ktime_add_ns(tv_start, KXO_PACE_SLACK_NS);
+    struct timerqueue_node *node;
+    while ((node = timerqueue_getnext(&rq->queue)) &&
+           !ktime_after(node->expires, horizon)) {
+        UserData *user_data = container_of(node, UserData, pace_node);
+        timerqueue_del(&rq->queue, node);
+        if (!READ_ONCE(user_data->unuse)) {
+            int qos = READ_ONCE(user_data->qos);
+            wake[qos] |=
+                kxo_runq_enqueue(&rq->runqs[qos], user_data, node->expires);
+        }
+        batch++;
+    }
+    if (!READ_ONCE(stopping))
+        kxo_rq_arm(rq);
+    spin_unlock(&rq->lock);
+
+    for (int qos = 0; qos < NR_KXO_QOS; qos++)
+        if (wake[qos])
+            kxo_runq_wake(&rq->runqs[qos]);
+
+    tv_end = ktime_get();
+
+    nsecs = (s64) ktime_to_ns(ktime_sub(tv_end, tv_start));
+
+    pr_info("kxo: [CPU#%d] %s: %d games of CPU#%d in %llu usec\n",
+            smp_processor_id(), __func__, batch, rq->cpu,
+            (unsigned long long) nsecs >> 10);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Put the move of a game back on the timerqueue of its home CPU */
+static void kxo_sched_defer(UserData *user_data, ktime_t until)
+{
+    struct kxo_rq *rq = per_cpu_ptr(&kxo_rqs, user_data->cpu);
+
+    spin_lock_bh(&rq->lock);
+    if (!READ_ONCE(user_data->unuse) &&
+        !timerqueue_node_queued(&user_data->pace_node)) {
+        user_data->pace_node.expires = until;
+        if (timerqueue_add(&rq->queue, &user_data->pace_node) &&
+            !READ_ONCE(stopping))
+            kxo_rq_arm(rq);
+    }
+    spin_unlock_bh(&rq->lock);
+}
+
+/* Take up to max games off runq, earliest deadline first */
+static int kxo_runq_take(struct kxo_runq *runq, UserData **batch, int max)
+{
+    struct timerqueue_node *node;
+    int n = 0;
+
+    spin_lock_bh(&runq->rq->lock);
+    while (n < max && (node = timerqueue_getnext(&runq->tree))) {
+        timerqueue_del(&runq->tree, node);
+        batch[n] = container_of(node, UserData, run_node);
+        batch[n++]->runq = NULL;
+    }
+    runq->nr_running -= n;
+    spin_unlock_bh(&runq->rq->lock);
+
+    return n;
+}
+
+/* Take the most urgent half of the most loaded busy peer of the same class */
+static int kxo_runq_steal(struct kxo_runq *runq, UserData **batch)
+{
+    struct kxo_runq *victim = NULL;
+    unsigned int most = 0;
+    int cpu;
+
+    for_each_cpu(cpu, &worker_mask) {
+        struct kxo_runq *peer = &per_cpu_ptr(&kxo_rqs, cpu)->runqs[runq->qos];
+        unsigned int nr = READ_ONCE(peer->nr_running);
+        if (peer == runq || !READ_ONCE(peer->busy) || nr <= most)
+            continue;
+        victim = peer;
+        most = nr;
+    }
+    if (!victim)
+        return 0;
+
+    return kxo_runq_take(victim, batch,
+                         min_t(int, (most + 1) / 2, KXO_BATCH));
+}
+
+static int kxo_lat_bucket(u64 ns)
+{
+    if (ns < 4)
+        return ns;
+    int msb = min(fls64(ns) - 1, 39);
+    return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+/* Upper bound of a bucket of the latency histogram */
+static u64 kxo_lat_bucket_limit(int bucket)
+{
+    if (bucket < 3)
+        return bucket + 1;
+    bucket++;
+    return (u64) (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+/* Search one reply of a game pondering on rq. Return false if none is. */
+static bool kxo_rq_ponder(struct kxo_rq *rq)
+{
+    UserData *user_data;
+
+    spin_lock_bh(&rq->lock);
+    user_data = list_first_entry_or_null(&rq->ponder_list, UserData,
+                                         ponder_node);
+    if (user_data)
+        list_del_init(&user_data->ponder_node);
+    spin_unlock_bh(&rq->lock);
+
+    if (!user_data)
+        return false;
+
+    struct kxo_budget *budget = user_data->tid_data->budget;
+    ktime_t until;
+    if (READ_ONCE(user_data->unuse) || !kxo_budget_admit(budget, &until))
+        return true;
+
+    /* Search each reply as long as it would be searched for real */
+    ktime_t start = ktime_get();
+    ktime_t deadline = kxo_budget_deadline(
+        budget, (u64) READ_ONCE(reply_deadline_us) * NSEC_PER_USEC);
+
+    struct mem_cgroup *memcg = kxo_budget_enter(budget);
+    bool more =
+        kxo_ponder_step(user_data, deadline, kxo_sched_slice_end(start));
+    kxo_budget_leave(memcg);
+    kxo_budget_charge(budget, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    if (more) {
+        spin_lock_bh(&rq->lock);
+        if (!READ_ONCE(user_data->unuse) && list_empty(&user_data->ponder_node))
+            list_add_tail(&user_data->ponder_node, &rq->ponder_list);
+        spin_unlock_bh(&rq->lock);
+    }
+    return true;
+}
+
+static int kxo_worker_func(void *arg)
+{
+    struct kxo_runq *runq = arg;
+    UserData *batch[KXO_BATCH];
+
+    while (!kthread_should_stop()) {
+        int idx = srcu_read_lock(&kxo_srcu);
+        int n = kxo_runq_take(runq, batch, KXO_BATCH);
+        bool stolen = false;
+
+        if (!n) {
+            n = kxo_runq_steal(runq, batch);
+            stolen = n > 0;
+        }
+        /* Nothing due, ponder on the time of the humans */
+        bool ponders = runq->qos == KXO_QOS_BACKGROUND;
+        if (!n && ponders && kxo_rq_ponder(runq->rq)) {
+            srcu_read_unlock(&kxo_srcu, idx);
+            cond_resched();
+            continue;
+        }
+        if (!n) {
+            srcu_read_unlock(&kxo_srcu, idx);
+            cpumask_set_cpu(runq->rq->cpu, &idle_mask[runq->qos]);
+            wait_event_interruptible(
+                runq->wait,
+                READ_ONCE(runq->nr_running) || READ_ONCE(runq->kicked) ||
+                    (ponders && !list_empty(&runq->rq->ponder_list)) ||
+                    kthread_should_stop());
+            cpumask_clear_cpu(runq->rq->cpu, &idle_mask[runq->qos]);
+            WRITE_ONCE(runq->kicked, false);
+            continue;
+        }
+
+        ktime_t batch_start = ktime_get();
+        u64 move_ns = 0, queue_ns = 0, late_ns = 0;
+        int played = 0, missed = 0, slices = 0;
+
+        WRITE_ONCE(runq->busy, true);
+        for (int i = 0; i < n; i++) {
+            UserData *user_data = batch[i];
+
+            atomic_set(&user_data->queued, 0);
+            if (READ_ONCE(user_data->unuse)) {
+                atomic64_inc(&cancelled);
+                continue;
+            }
+
+            /* Self-play of a process out of CPU budget waits for a refill,
+             * replies to a human are played with a shorter search instead.
+             */
+            struct kxo_budget *budget = user_data->tid_data->budget;
+            ktime_t until;
+            if (runq->qos == KXO_QOS_BACKGROUND &&
+                !kxo_budget_admit(budget, &until)) {
+                kxo_sched_defer(user_data, until);
+                continue;
+            }
+
+            /* The fifo parks a game before its reader falls too far behind,
+             * a mapped ring has no watermark: the move waits for room
+             * instead of being computed and dropped
+             */
+            struct kxo_ring *ring =
+                smp_load_acquire(&user_data->tid_data->ring);
+            if (!kxo_ring_reserve(ring)) {
+                atomic64_inc(&ring_full);
+                kxo_sched_defer(user_data,
+                                ktime_add_ns(ktime_get(), KXO_RING_RETRY_NS));
+                continue;
+            }
+
+            /* Queue latency is that of the first slice of a move */
+            ktime_t move_start = ktime_get();
+            if (!user_data->suspended) {
+                u64 wait_ns = ktime_to_ns(
+                    ktime_sub(move_start, user_data->runnable_at));
+                int bucket = kxo_lat_bucket(wait_ns);
+                WRITE_ONCE(runq->latency[bucket], runq->latency[bucket] + 1);
+                queue_ns += wait_ns;
+            }
+
+            /* The slack until the deadline is shared with the games waiting
+             * behind this one. A resumed search keeps the deadline it was
+             * started with.
+             */
+            ktime_t deadline = user_data->run_node.expires;
+            if (!user_data->suspended) {
+                s64 slack = ktime_to_ns(ktime_sub(deadline, move_start));
+                u32 sharing = READ_ONCE(runq->nr_running) + n - i;
+                u64 search_ns = slack > 0 ? div_u64(slack, sharing) : 0;
+                user_data->search_deadline = kxo_budget_deadline(
+                    budget, max_t(u64, search_ns, KXO_MIN_SEARCH_NS));
+            }
+            user_data->slice_end = kxo_sched_slice_end(move_start);
+
+            struct mem_cgroup *memcg = kxo_budget_enter(budget);
+            bool done = ai_play_move(user_data);
+            kxo_budget_leave(memcg);
+            kxo_ring_unreserve(ring);
+
+            ktime_t move_end = ktime_get();
+            u64 ns = ktime_to_ns(ktime_sub(move_end, move_start));
+            kxo_budget_charge(budget, ns);
+            move_ns += ns;
+            if (READ_ONCE(user_data->unuse)) {
+                atomic64_inc(&cancelled);
+            } else if (!done) {
+                kxo_runq_requeue(user_data);
+                slices++;
+            } else {
+                if (ktime_after(move_end, deadline)) {
+                    late_ns += ktime_to_ns(ktime_sub(move_end, deadline));
+                    missed++;
+                }
+                played++;
+            }
+
+            /* Between slices, let anything else runnable on the CPU run */
+            cond_resched();
+        }
+        WRITE_ONCE(runq->busy, false);
+
+        WRITE_ONCE(runq->moves, runq->moves + played);
+        WRITE_ONCE(runq->yields, runq->yields + slices);
+        WRITE_ONCE(runq->batches, runq->batches + 1);
+        if (stolen)
+            WRITE_ONCE(runq->steals, runq->steals + n);
+        WRITE_ONCE(runq->move_ns, runq->move_ns + move_ns);
+        WRITE_ONCE(runq->queue_ns, runq->queue_ns + queue_ns);
+        WRITE_ONCE(runq->missed, runq->missed + missed);
+        WRITE_ONCE(runq->late_ns, runq->late_ns + late_ns);
+        WRITE_ONCE(runq->busy_ns,
+                   runq->busy_ns +
+                       ktime_to_ns(ktime_sub(ktime_get(), batch_start)));
+
+        srcu_read_unlock(&kxo_srcu, idx);
+        cond_resched();
+    }
+
+    return 0;
+}
+
+int kxo_sched_pick_cpu(void)
+{
+    int best = cpumask_first(&worker_mask), cpu;
+    int best_load = INT_MAX;
+
+    /* The least loaded online worker CPU becomes the home of the new game */
+    cpus_read_lock();
+    for_each_cpu_and(cpu, &worker_mask, cpu_online_mask) {
+        int load = atomic_read(&per_cpu(kxo_rqs, cpu).nr_games);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    atomic_inc(&per_cpu(kxo_rqs, best).nr_games);
+    cpus_read_unlock();
+
+    return best;
+}
+
+void kxo_sched_put_cpu(int cpu)
+{
+    atomic_dec(&per_cpu(kxo_rqs, cpu).nr_games);
+}
+
+unsigned int kxo_sched_default_pace(void)
+{
+    return READ_ONCE(default_pace_us);
+}
+
+unsigned int kxo_sched_fifo_size(void)
+{
+    unsigned int high_wm = clamp(READ_ONCE(fifo_high_wm), 2U, (u32) PAGE_SIZE);
+    return roundup_pow_of_two(high_wm);
+}
+
+static void kxo_sched_unparked(UserData *user_data, s64 since)
+{
+    s64 ns = ktime_to_ns(ktime_get()) - since;
+    u64 pace_ns = (u64) READ_ONCE(user_data->pace_us) * NSEC_PER_USEC;
+
+    atomic_dec(&nr_parked);
+    atomic64_add(ns, &parked_ns);
+    /* The move held back, and those it would have been followed by */
+    atomic64_add(1 + (pace_ns ? div64_u64(ns, pace_ns) : 0), &avoided_moves);
+}
+
+/* Park a game whose reader fell behind. Return false if it may move. */
+static bool kxo_sched_park(UserData *user_data)
+{
+    /* Full before the high watermark if that was raised since the fifo was
+     * sized
+     */
+    if (kfifo_len(&user_data->user_fifo) < READ_ONCE(fifo_high_wm) &&
+        !kfifo_is_full(&user_data->user_fifo))
+        return false;
+
+    atomic64_set(&user_data->parked_since, ktime_to_ns(ktime_get()));
+    atomic_inc(&nr_parked);
+    smp_mb__after_atomic();
+
+    /* Drained meanwhile, the reader may have missed that we parked */
+    if (kfifo_len(&user_data->user_fifo) <= READ_ONCE(fifo_low_wm)) {
+        s64 since = atomic64_xchg(&user_data->parked_since, 0);
+        if (since) {
+            kxo_sched_unparked(user_data, since);
+            return false;
+        }
+    }
+    return true;
+}
+
+void kxo_sched_game_drained(UserData *user_data)
+{
+    /* Order the fifo out index the reader just stored before the load of
+     * parked_since, pairs with smp_mb__after_atomic() in kxo_sched_park():
+     * either the reader sees the game parked, or the worker sees it drained.
+     */
+    smp_mb();
+    if (!atomic64_read(&user_data->parked_since) ||
+        kfifo_len(&user_data->user_fifo) > READ_ONCE(fifo_low_wm))
+        return;
+
+    s64 since = atomic64_xchg(&user_data->parked_since, 0);
+    if (!since)
+        return;
+    kxo_sched_unparked(user_data, since);
+    kxo_sched_game_ready(user_data);
+}
+
+/* Called with rq->lock held. Queue the move of a paced game, due on the
+ * grid of multiples of its pace.
+ */
+static void kxo_rq_pace(struct kxo_rq *rq, UserData *user_data, u64 pace_ns)
+{
+    u64 now = ktime_to_ns(ktime_get());
+
+    user_data->pace_node.expires =
+        ns_to_ktime((div64_u64(now, pace_ns) + 1) * pace_ns);
+    if (timerqueue_add(&rq->queue, &user_data->pace_node) &&
+        !READ_ONCE(stopping))
+        kxo_rq_arm(rq);
+}
+
+void kxo_sched_game_ready(UserData *user_data)
+{
+    if (READ_ONCE(user_data->unuse) || READ_ONCE(stopping) ||
+        !get_turn_function(user_data) || kxo_sched_park(user_data))
+        return;
+
+    /* Someone in userspace is waiting for this reply */
+    u64 pace_ns = (u64) READ_ONCE(user_data->pace_us) * NSEC_PER_USEC;
+    if (!pace_ns || READ_ONCE(unthrottled) || !user_data->ai1_func ||
+        !user_data->ai2_func) {
+        kxo_sched_dispatch(user_data);
+        return;
+    }
+
+    struct kxo_rq *rq = per_cpu_ptr(&kxo_rqs, user_data->cpu);
+
+    spin_lock_bh(&rq->lock);
+    if (!READ_ONCE(user_data->unuse) &&
+        !timerqueue_node_queued(&user_data->pace_node))
+        kxo_rq_pace(rq, user_data, pace_ns);
+    spin_unlock_bh(&rq->lock);
+}
+
+void kxo_sched_set_pace(UserData *user_data, unsigned int pace_us)
+{
+    struct kxo_rq *rq = per_cpu_ptr(&kxo_rqs, user_data->cpu);
+    u64 pace_ns = (u64) pace_us * NSEC_PER_USEC;
+    int qos = READ_ONCE(user_data->qos);
+    bool wake = false;
+
+    WRITE_ONCE(user_data->pace_us, pace_us);
+
+    /* A move already waiting is due on the grid of the new pace, or at once
+     * if the game is no longer paced
+     */
+    spin_lock_bh(&rq->lock);
+    if (!READ_ONCE(user_data->unuse) &&
+        timerqueue_node_queued(&user_data->pace_node)) {
+        timerqueue_del(&rq->queue, &user_data->pace_node);
+        if (pace_ns && !READ_ONCE(unthrottled) && user_data->ai1_func &&
+            user_data->ai2_func)
+            kxo_rq_pace(rq, user_data, pace_ns);
+        else
+            wake = kxo_runq_enqueue(&rq->runqs[qos], user_data, ktime_get());
+    }
+    spin_unlock_bh(&rq->lock);
+
+    if (wake)
+        kxo_runq_wake(&rq->runqs[qos]);
+}
+
+void kxo_sched_ponder(UserData *user_data)
+{
+    struct kxo_rq *rq = per_cpu_ptr(&kxo_rqs, user_data->cpu);
+
+    spin_lock_bh(&rq->lock);
+    if (!READ_ONCE(user_data->unuse) && list_empty(&user_data->ponder_node))
+        list_add_tail(&user_data->ponder_node, &rq->ponder_list);
+    spin_unlock_bh(&rq->lock);
+
+    wake_up(&rq->runqs[KXO_QOS_BACKGROUND].wait);
+}
+
+void kxo_sched_cancel(UserData *user_data)
+{
+    struct kxo_rq *rq = per_cpu_ptr(&kxo_rqs, user_data->cpu);
+    s64 since = atomic64_xchg(&user_data->parked_since, 0);
+
+    if (since)
+        kxo_sched_unparked(user_data, since);
+
+    /* Games only wait on the queues of their home CPU, and unuse is set,
+     * so none takes the game back once this is done.
+     */
+    spin_lock_bh(&rq->lock);
+    if (timerqueue_node_queued(&user_data->pace_node))
+        timerqueue_del(&rq->queue, &user_data->pace_node);
+    list_del_init(&user_data->ponder_node);
+    struct kxo_runq *runq = user_data->runq;
+    if (runq) {
+        timerqueue_del(&runq->tree, &user_data->run_node);
+        user_data->runq = NULL;
+        runq->nr_running--;
+        atomic64_inc(&cancelled);
+    }
+    spin_unlock_bh(&rq->lock);
+}
+
+void kxo_sched_synchronize(void)
+{
+    synchronize_srcu(&kxo_srcu);
+}
+
+static void reap_work_func(struct work_struct *w)
+{
+    user_list_reap();
+}
+
+void kxo_sched_reap(void)
+{
+    if (!READ_ONCE(stopping))
+        schedule_work(&reap_work);
+}
+
+/* Statistics of the worker pool, in /sys/class/kxo/kxo/sched/, and of each
+ * QoS class, in /sys/class/kxo/kxo/<class>/
+ */
+
+#define KXO_RUNQ_SUM(qos, field)                                          \
+    ({                                                                    \
+        u64 __sum = 0;                                                    \
+        int __cpu;                                                        \
+        for_each_cpu(__cpu, &worker_mask)                                 \
+            __sum += READ_ONCE(per_cpu(kxo_rqs, __cpu).runqs[qos].field); \
+        __sum;                                                            \
+    })
+
+#define KXO_RQ_SUM(field)                                \
+    ({                                                   \
+        u64 __total = 0;                                 \
+        for (int __qos = 0; __qos < NR_KXO_QOS; __qos++) \
+            __total += KXO_RUNQ_SUM(__qos, field);       \
+        __total;                                         \
+    })
+
+static ssize_t workers_show(struct device *dev,
+                            struct device_attribute *attr,
+                            char *buf)
+{
+    return sysfs_emit(buf, "%*pbl\n", cpumask_pr_args(&worker_mask));
+}
+static DEVICE_ATTR_RO(workers);
+
+static ssize_t moves_show(struct device *dev,
+                          struct device_attribute *attr,
+                          char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", KXO_RQ_SUM(moves));
+}
+static DEVICE_ATTR_RO(moves);
+
+/* Moves per second over the last second or more between two reads */
+static DEFINE_SPINLOCK(rate_lock);
+static ktime_t rate_stamp;
+static u64 rate_moves, rate_value;
+
+static ssize_t moves_per_sec_show(struct device *dev,
+                                  struct device_attribute *attr,
+                                  char *buf)
+{
+    u64 moves = KXO_RQ_SUM(moves), rate;
+    ktime_t now = ktime_get();
+
+    spin_lock(&rate_lock);
+    s64 elapsed = ktime_to_ns(ktime_sub(now, rate_stamp));
+    if (elapsed >= NSEC_PER_SEC) {
+        rate_value = div64_u64((moves - rate_moves) * NSEC_PER_SEC, elapsed);
+        rate_moves = moves;
+        rate_stamp = now;
+    }
+    rate = rate_value;
+    spin_unlock(&rate_lock);
+
+    return sysfs_emit(buf, "%llu\n", rate);
+}
+static DEVICE_ATTR_RO(moves_per_sec);
+
+static ssize_t batches_show(struct device *dev,
+                            struct device_attribute *attr,
+                            char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", KXO_RQ_SUM(batches));
+}
+static DEVICE_ATTR_RO(batches);
+
+static ssize_t steals_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", KXO_RQ_SUM(steals));
+}
+static DEVICE_ATTR_RO(steals);
+
+static ssize_t yields_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", KXO_RQ_SUM(yields));
+}
+static DEVICE_ATTR_RO(yields);
+
+/* Time a worker spends per move outside of the move itself */
+static ssize_t overhead_ns_show(struct device *dev,
+                                struct device_attribute *attr,
+                                char *buf)
+{
+    u64 moves = KXO_RQ_SUM(moves);
+    u64 overhead = KXO_RQ_SUM(busy_ns) - KXO_RQ_SUM(move_ns);
+
+    return sysfs_emit(buf, "%llu\n", moves ? div64_u64(overhead, moves) : 0);
+}
+static DEVICE_ATTR_RO(overhead_ns);
+
+/* Time a move waits between being due and a worker starting it */
+static ssize_t queue_latency_ns_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf)
+{
+    u64 moves = KXO_RQ_SUM(moves);
+    u64 queue_ns = KXO_RQ_SUM(queue_ns);
+
+    return sysfs_emit(buf, "%llu\n", moves ? div64_u64(queue_ns, moves) : 0);
+}
+static DEVICE_ATTR_RO(queue_latency_ns);
+
+static ssize_t missed_deadlines_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", KXO_RQ_SUM(missed));
+}
+static DEVICE_ATTR_RO(missed_deadlines);
+
+/* By how much a move done past its deadline missed it */
+static ssize_t lateness_ns_show(struct device *dev,
+                                struct device_attribute *attr,
+                                char *buf)
+{
+    u64 missed = KXO_RQ_SUM(missed);
+    u64 late_ns = KXO_RQ_SUM(late_ns);
+
+    return sysfs_emit(buf, "%llu\n", missed ? div64_u64(late_ns, missed) : 0);
+}
+static DEVICE_ATTR_RO(lateness_ns);
+
+static ssize_t parked_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    return sysfs_emit(buf, "%d\n", atomic_read(&nr_parked));
+}
+static DEVICE_ATTR_RO(parked);
+
+static ssize_t parked_ns_show(struct device *dev,
+                              struct device_attribute *attr,
+                              char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&parked_ns));
+}
+static DEVICE_ATTR_RO(parked_ns);
+
+static ssize_t avoided_moves_show(struct device *dev,
+                                  struct device_attribute *attr,
+                                  char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&avoided_moves));
+}
+static DEVICE_ATTR_RO(avoided_moves);
+
+static ssize_t ring_full_show(struct device *dev,
+                              struct device_attribute *attr,
+                              char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&ring_full));
+}
+static DEVICE_ATTR_RO(ring_full);
+
+static ssize_t cancelled_show(struct device *dev,
+                              struct device_attribute *attr,
+                              char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&cancelled));
+}
+static DEVICE_ATTR_RO(cancelled);
+
+static struct attribute *kxo_sched_attrs[] = {
+    &dev_attr_workers.attr,
+    &dev_attr_moves.attr,
+    &dev_attr_moves_per_sec.attr,
+    &dev_attr_batches.attr,
+    &dev_attr_steals.attr,
+    &dev_attr_yields.attr,
+    &dev_attr_overhead_ns.attr,
+    &dev_attr_queue_latency_ns.attr,
+    &dev_attr_missed_deadlines.attr,
+    &dev_attr_lateness_ns.attr,
+    &dev_attr_parked.attr,
+    &dev_attr_parked_ns.attr,
+    &dev_attr_avoided_moves.attr,
+    &dev_attr_ring_full.attr,
+    &dev_attr_cancelled.attr,
+    NULL,
+};
+
+const struct attribute_group kxo_sched_group = {
+    .name = "sched",
+    .attrs = kxo_sched_attrs,
+};
+
+/* Queue latency under which a share of the moves of a class waited */
+static u64 kxo_qos_latency(int qos, unsigned int per_mille)
+{
+    u64 moves = 0, seen = 0;
+    int bucket, cpu;
+
+    u64 hist[KXO_LAT_BUCKETS] = {0};
+
+    for_each_cpu(cpu, &worker_mask) {
+        struct kxo_runq *runq = &per_cpu_ptr(&kxo_rqs, cpu)->runqs[qos];
+        for (bucket = 0; bucket < KXO_LAT_BUCKETS; bucket++)
+            hist[bucket] += READ_ONCE(runq->latency[bucket]);
+    }
+    for (bucket = 0; bucket < KXO_LAT_BUCKETS; bucket++)
+        moves += hist[bucket];
+    if (!moves)
+        return 0;
+
+    u64 rank = div_u64(moves * per_mille + 999, 1000);
+    for (bucket = 0; bucket < KXO_LAT_BUCKETS - 1; bucket++) {
+        seen += hist[bucket];
+        if (seen >= rank)
+            break;
+    }
+    return kxo_lat_bucket_limit(bucket);
+}
+
+static u64 kxo_qos_moves(int qos)
+{
+    return KXO_RUNQ_SUM(qos, moves);
+}
+
+static u64 kxo_qos_queue_latency(int qos)
+{
+    u64 moves = KXO_RUNQ_SUM(qos, moves);
+    return moves ? div64_u64(KXO_RUNQ_SUM(qos, queue_ns), moves) : 0;
+}
+
+static u64 kxo_qos_missed(int qos)
+{
+    return KXO_RUNQ_SUM(qos, missed);
+}
+
+static u64 kxo_qos_latency_p50(int qos)
+{
+    return kxo_qos_latency(qos, 500);
+}
+
+static u64 kxo_qos_latency_p99(int qos)
+{
+    return kxo_qos_latency(qos, 990);
+}
+
+struct kxo_qos_attribute {
+    struct device_attribute attr;
+    int qos;
+    u64 (*stat)(int qos);
+};
+
+static ssize_t kxo_qos_show(struct device *dev,
+                            struct device_attribute *attr,
+                            char *buf)
+{
+    struct kxo_qos_attribute *qos_attr =
+        container_of(attr, struct kxo_qos_attribute, attr);
+    return sysfs_emit(buf, "%llu\n", qos_attr->stat(qos_attr->qos));
+}
+
+#define KXO_QOS_ATTR(class, _qos, name, _stat)               \
+    static struct kxo_qos_attribute kxo_##class##_##name = { \
+        .attr = __ATTR(name, 0444, kxo_qos_show, NULL),      \
+        .qos = _qos,                                         \
+        .stat = _stat,                                       \
+    }
+
+#define KXO_QOS_GROUP(class, qos)                                      \
+    KXO_QOS_ATTR(class, qos, moves, kxo_qos_moves);                    \
+    KXO_QOS_ATTR(class, qos, queue_latency_ns, kxo_qos_queue_latency); \
+    KXO_QOS_ATTR(class, qos, latency_p50_ns, kxo_qos_latency_p50);     \
+    KXO_QOS_ATTR(class, qos, latency_p99_ns, kxo_qos_latency_p99);     \
+    KXO_QOS_ATTR(class, qos, missed_deadlines, kxo_qos_missed);        \
+    static struct attribute *kxo_##class##_attrs[] = {                 \
+        &kxo_##class##_moves.attr.attr,                                \
+        &kxo_##class##_queue_latency_ns.attr.attr,                     \
+        &kxo_##class##_latency_p50_ns.attr.attr,                       \
+        &kxo_##class##_latency_p99_ns.attr.attr,                       \
+        &kxo_##class##_missed_deadlines.attr.attr,                     \
+        NULL,                                                          \
+    };                                                                 \
+    const struct attribute_group kxo_##class##_group = {               \
+        .name = #class,                                                \
+        .attrs = kxo_##class##_attrs,                                  \
+    }
+
+KXO_QOS_GROUP(interactive, KXO_QOS_INTERACTIVE);
+KXO_QOS_GROUP(background, KXO_QOS_BACKGROUND);
+
+static void kxo_sched_stop_workers(void)
+{
+    int cpu;
+    for_each_cpu(cpu, &worker_mask) {
+        struct kxo_rq *rq = per_cpu_ptr(&kxo_rqs, cpu);
+        for (int qos = 0; qos < NR_KXO_QOS; qos++) {
+            if (rq->runqs[qos].worker)
+                kthread_stop(rq->runqs[qos].worker);
+            rq->runqs[qos].worker = NULL;
+        }
+    }
+}
+
+static const char *const kxo_worker_names[NR_KXO_QOS] = {
+    [KXO_QOS_INTERACTIVE] = "kxo_ia/%u",
+    [KXO_QOS_BACKGROUND] = "kxo_worker/%u",
+};
+
+static int kxo_sched_start_workers(void)
+{
+    int cpu;
+
+    if (worker_cpus) {
+        if (cpulist_parse(worker_cpus, &worker_mask))
+            return -EINVAL;
+    } else {
+        cpumask_copy(&worker_mask, cpu_possible_mask);
+    }
+
+    /* The pool is fixed at load time. A worker CPU taken offline later
+     * keeps its games, its workers then run wherever the scheduler puts them.
+     */
+    cpus_read_lock();
+    cpumask_and(&worker_mask, &worker_mask, cpu_online_mask);
+    for_each_cpu(cpu, &worker_mask) {
+        for (int qos = 0; qos < NR_KXO_QOS; qos++) {
+            struct kxo_runq *runq = &per_cpu_ptr(&kxo_rqs, cpu)->runqs[qos];
+            runq->worker = kthread_create_on_cpu(kxo_worker_func, runq, cpu,
+                                                 kxo_worker_names[qos]);
+            if (IS_ERR(runq->worker)) {
+                int ret = PTR_ERR(runq->worker);
+                runq->worker = NULL;
+                cpus_read_unlock();
+                kxo_sched_stop_workers();
+                return ret;
+            }
+            /* Replies to a human come before self-play on the same CPU */
+            if (qos == KXO_QOS_INTERACTIVE)
+                sched_set_normal(runq->worker, MIN_NICE);
+            wake_up_process(runq->worker);
+        }
+    }
+    cpus_read_unlock();
+
+    return cpumask_empty(&worker_mask) ? -EINVAL : 0;
+}
+
+int kxo_sched_init(void)
+{
+    int cpu, ret;
+
+    for_each_possible_cpu(cpu) {
+        struct kxo_rq *rq = per_cpu_ptr(&kxo_rqs, cpu);
+        spin_lock_init(&rq->lock);
+        timerqueue_init_head(&rq->queue);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+        hrtimer_init(&rq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+        rq->timer.function = kxo_rq_timer_func;
+#else
+        hrtimer_setup(&rq->timer, kxo_rq_timer_func, CLOCK_MONOTONIC,
+                      HRTIMER_MODE_ABS_SOFT);
+#endif
+        atomic_set(&rq->nr_games, 0);
+        rq->cpu = cpu;
+        INIT_LIST_HEAD(&rq->ponder_list);
+        for (int qos = 0; qos < NR_KXO_QOS; qos++) {
+            struct kxo_runq *runq = &rq->runqs[qos];
+            runq->rq = rq;
+            runq->qos = qos;
+            timerqueue_init_head(&runq->tree);
+            runq->nr_running = 0;
+            init_waitqueue_head(&runq->wait);
+        }
+    }
+    for (int qos = 0; qos < NR_KXO_QOS; qos++)
+        cpumask_clear(&idle_mask[qos]);
+    rate_stamp = ktime_get();
+
+    INIT_WORK(&reap_work, reap_work_func);
+    stopping = false;
+
+    ret = kxo_sched_start_workers();
+    if (ret)
+        pr_err("kxo: cannot start workers on CPUs \"%s\"\n",
+               worker_cpus ? worker_cpus : "all");
+    return ret;
+}
+
+static void kxo_sched_cancel_timers(void)
+{
+    int cpu;
+    for_each_possible_cpu(cpu)
+        hrtimer_cancel(&per_cpu(kxo_rqs, cpu).timer);
+}
+
+void kxo_sched_exit(void)
+{
+    /* Keep finishing moves from scheduling new ones */
+    WRITE_ONCE(stopping, true);
+    kxo_sched_cancel_timers();
+    kxo_sched_stop_workers();
+    kxo_sched_cancel_timers();
+    cancel_work_sync(&reap_work);
+}
@@ -0,0 +1,87 @@
+#ifndef KXO_SCHED_H
+#define KXO_SCHED_H
+
+#include <linux/sysfs.h>
+#include "type.h"
+
+int kxo_sched_init(void);
+void kxo_sched_exit(void);
+
+/* Worker pool statistics, a "sched" directory of the device, and statistics
+ * of each QoS class in a directory named after it
+ */
+extern const struct attribute_group kxo_sched_group;
+extern const struct attribute_group kxo_interactive_group;
+extern const struct attribute_group kxo_background_group;
+
+/**
+ * kxo_sched_pick_cpu - Choose the home CPU of a new game.
+ *
+ * Return: The online CPU of the worker pool with the fewest games. Its moves
+ * run there, or on an idle peer, and its data should be allocated on its
+ * node. Release with kxo_sched_put_cpu().
+ */
+int kxo_sched_pick_cpu(void);
+void kxo_sched_put_cpu(int cpu);
+
+/* Pace of a newly created game, in microseconds */
+unsigned int kxo_sched_default_pace(void);
+
+/* Size of the fifo of a newly created game: the moves it may have unread
+ * before it is parked, rounded up to a power of two
+ */
+unsigned int kxo_sched_fifo_size(void);
+
+/**
+ * kxo_sched_game_ready - Schedule the next move of a game if it belongs to
+ * the kernel. Call after the game is created and after every move.
+ *
+ * @user_data: The game.
+ *
+ * Replies to a userspace player are dispatched at once. Moves of AI-vs-AI
+ * games are queued on the run queue of their home CPU, due one pace after
+ * the previous one, on a grid of multiples of the pace, so that games
+ * sharing a pace are woken up together.
+ *
+ * A move has to be done one pace after it is due, replies within
+ * reply_deadline_us. Workers play the earliest deadline first and give the
+ * engine its share of the time left until the deadline.
+ */
+void kxo_sched_game_ready(UserData *user_data);
+
+/**
+ * kxo_sched_set_pace - Change the pace of a game.
+ *
+ * @user_data: The game.
+ * @pace_us: Time between two of its AI-vs-AI moves, 0 for no wait.
+ *
+ * A move already waiting for its time is moved to the grid of the new pace,
+ * so a shorter pace takes effect on the next move rather than the one after.
+ */
+void kxo_sched_set_pace(UserData *user_data, unsigned int pace_us);
+
+/**
+ * kxo_sched_game_drained - Resume a game parked by backpressure. Call after
+ * reading from its fifo.
+ *
+ * @user_data: The game.
+ *
+ * A game stops computing moves when fifo_high_wm moves of its fifo are
+ * unread, until the reader brings it down to fifo_low_wm.
+ */
+void kxo_sched_game_drained(UserData *user_data);
+
+// let an idle worker search the replies prepared by kxo_ponder_start()
+void kxo_sched_ponder(UserData *user_data);
+
+// drop a closed game's pending move, whether paced or waiting for a worker
+void kxo_sched_cancel(UserData *user_data);
+
+// collect the games of closed sessions
+void kxo_sched_reap(void);
+
+/* Wait until no worker holds a game it took before kxo_sched_cancel() was
+ * called on it.
+ */
+void kxo_sched_synchronize(void);
+#endif
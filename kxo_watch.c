@@ -0,0 +1,465 @@
+#include <linux/capability.h>
+#include <linux/cred.h>
+#include <linux/device.h>
+#include <linux/log2.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+
+#include "kxo_ring.h"
+#include "kxo_watch.h"
+
+static unsigned int watch_ring_events = 1024;
+module_param(watch_ring_events, uint, 0444);
+MODULE_PARM_DESC(watch_ring_events,
+                 "Moves kept for spectators on each CPU, rounded up to a "
+                 "power of two");
+
+struct kxo_watch_slot {
+    u64 seq;  // of the move it holds, U64_MAX while it is written
+    struct kxo_watch_event event;
+    kuid_t uid;  // who opened the session of the game
+};
+
+/* Moves shared by all spectators, one ring per CPU written by the players
+ * running there, the oldest overwritten. Readers check the seq of a slot
+ * before and after copying it, like a seqcount.
+ */
+struct kxo_watch_ring {
+    u64 head;  // seq of the next move, stored with release
+    struct kxo_watch_slot *slots;
+    struct wait_queue_head wait;  // readers, and pollers, of any ring
+};
+
+static DEFINE_PER_CPU(struct kxo_watch_ring, watch_rings);
+static u64 watch_mask;  // of the slots of every ring
+
+/* Where a spectator is in the ring of one CPU */
+struct kxo_watch_cursor {
+    u64 seq;                     // next move to read
+    struct kxo_watch_slot next;  // copy of that move while peeked
+    bool peeked;                 // during kxo_watch_copy()
+};
+
+/* A session spectating, see KXO_IOC_WATCH */
+struct kxo_watcher {
+    struct mutex lock;  // one reader at a time
+    u32 session_id, game_id;
+    kuid_t uid;  // sees the games of the sessions this user opened
+    bool admin;  // sees every game
+    struct kxo_watch_cursor cpus[];  // by CPU
+};
+
+static atomic_t nr_watchers;
+static atomic64_t lost_moves;
+
+int kxo_watch_init(void)
+{
+    unsigned int n =
+        roundup_pow_of_two(clamp(watch_ring_events, 2U, 1U << 16));
+    int cpu;
+
+    watch_mask = n - 1;
+    for_each_possible_cpu(cpu) {
+        struct kxo_watch_ring *r = per_cpu_ptr(&watch_rings, cpu);
+
+        r->slots = kvzalloc_node(array_size(n, sizeof(*r->slots)),
+                                 GFP_KERNEL, cpu_to_node(cpu));
+        if (!r->slots) {
+            kxo_watch_exit();
+            return -ENOMEM;
+        }
+        for (unsigned int i = 0; i < n; i++)
+            r->slots[i].seq = U64_MAX;
+        r->head = 0;
+        init_waitqueue_head(&r->wait);
+    }
+    return 0;
+}
+
+void kxo_watch_exit(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        kvfree(per_cpu(watch_rings, cpu).slots);
+        per_cpu(watch_rings, cpu).slots = NULL;
+    }
+}
+
+void kxo_watch_publish(UserData *user_data, int move, char player, char win)
+{
+    if (!atomic_read(&nr_watchers))
+        return;
+
+    /* Players run in process context, the ring of a CPU has a single writer
+     * while preemption is off
+     */
+    struct kxo_watch_ring *r = get_cpu_ptr(&watch_rings);
+    u64 seq = r->head;
+    struct kxo_watch_slot *slot = &r->slots[seq & watch_mask];
+    WRITE_ONCE(slot->seq, U64_MAX);
+    smp_wmb();
+    kxo_event_init(&slot->event.event, user_data->id, move, player, win);
+    slot->event.session_id = user_data->tid_data->session_id;
+    slot->event.pad = 0;
+    slot->uid = user_data->tid_data->uid;
+    smp_store_release(&slot->seq, seq);
+    smp_store_release(&r->head, seq + 1);
+    put_cpu_ptr(&watch_rings);
+
+    if (wq_has_sleeper(&r->wait))
+        wake_up_interruptible(&r->wait);
+}
+
+// start from the next move of every CPU
+static void kxo_watch_catch_up(struct kxo_watcher *w)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct kxo_watch_ring *r = per_cpu_ptr(&watch_rings, cpu);
+
+        WRITE_ONCE(w->cpus[cpu].seq, smp_load_acquire(&r->head));
+        w->cpus[cpu].peeked = false;
+    }
+}
+
+// whether a move was played on any CPU since the cursors of w
+static bool kxo_watch_pending(struct kxo_watcher *w)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct kxo_watch_ring *r = per_cpu_ptr(&watch_rings, cpu);
+
+        if (READ_ONCE(w->cpus[cpu].seq) != smp_load_acquire(&r->head))
+            return true;
+    }
+    return false;
+}
+
+int kxo_watch_start(TidData *tid_data, u32 session_id, u32 game_id)
+{
+    struct kxo_watcher *w = READ_ONCE(tid_data->watcher);
+    bool admin = capable(CAP_SYS_ADMIN);
+
+    if (!w) {
+        w = kvmalloc(struct_size(w, cpus, nr_cpu_ids), GFP_KERNEL);
+        if (!w)
+            return -ENOMEM;
+        mutex_init(&w->lock);
+        kxo_watch_catch_up(w);
+        w->session_id = session_id;
+        w->game_id = game_id;
+        w->uid = tid_data->uid;
+        w->admin = admin;
+
+        /* Started by another thread meanwhile */
+        struct kxo_watcher *old = cmpxchg(&tid_data->watcher, NULL, w);
+        if (!old) {
+            atomic_inc(&nr_watchers);
+            return 0;
+        }
+        kvfree(w);
+        w = old;
+    }
+
+    mutex_lock(&w->lock);
+    kxo_watch_catch_up(w);
+    w->session_id = session_id;
+    w->game_id = game_id;
+    w->admin = admin;
+    mutex_unlock(&w->lock);
+    return 0;
+}
+
+static bool kxo_watch_match(const struct kxo_watcher *w,
+                            const struct kxo_watch_event *event,
+                            kuid_t uid)
+{
+    return (w->admin || uid_eq(w->uid, uid)) &&
+           (w->session_id == KXO_WATCH_ANY ||
+            w->session_id == event->session_id) &&
+           (w->game_id == KXO_WATCH_ANY ||
+            w->game_id == event->event.game_id);
+}
+
+/* Copy the move at the cursor c of ring r to c->next, skipping those
+ * overwritten before they could be read and adding them to *missed. Returns
+ * false at the head of the ring.
+ */
+static bool kxo_watch_peek(struct kxo_watch_ring *r,
+                           struct kxo_watch_cursor *c,
+                           u64 *missed)
+{
+    u64 head = smp_load_acquire(&r->head), seq = c->seq;
+    bool found = false;
+
+    if (head - seq > watch_mask + 1) {
+        *missed += head - (watch_mask + 1) - seq;
+        seq = head - (watch_mask + 1);
+    }
+    for (; seq != head; seq++, (*missed)++) {
+        struct kxo_watch_slot *slot = &r->slots[seq & watch_mask];
+
+        /* Overwritten since head was loaded */
+        if (smp_load_acquire(&slot->seq) != seq)
+            continue;
+        memcpy(&c->next, slot, sizeof(*slot));
+        smp_rmb();
+        if (READ_ONCE(slot->seq) == seq) {
+            found = true;
+            break;
+        }
+    }
+    WRITE_ONCE(c->seq, seq);
+    return found;
+}
+
+/* Copy the n moves batched to buf + *done. On a fault the cursors go back
+ * to the first move not copied, for the next read to retry.
+ */
+static int kxo_watch_flush(struct kxo_watcher *w,
+                           struct kxo_watch_event __user *buf,
+                           const struct kxo_watch_event *events,
+                           const int *cpus,
+                           const u64 *seqs,
+                           u32 n,
+                           u32 *done)
+{
+    unsigned long left =
+        copy_to_user(buf + *done, events, n * sizeof(*events));
+    u32 copied = n - DIV_ROUND_UP(left, sizeof(*events));
+
+    *done += copied;
+    if (!left)
+        return 0;
+    for (u32 i = n; i-- > copied;) {
+        WRITE_ONCE(w->cpus[cpus[i]].seq, seqs[i]);
+        w->cpus[cpus[i]].peeked = false;
+    }
+    return -EFAULT;
+}
+
+/* Copy the watched moves from the cursors of w on, as many as fit in the
+ * room left after *done, adding those overwritten before they were read to
+ * *missed. The rings are merged by the time of their moves, so that the
+ * moves of a game come in the order they were played wherever they ran.
+ */
+static int kxo_watch_copy(struct kxo_watcher *w,
+                          struct kxo_watch_event __user *buf,
+                          u32 room,
+                          u32 *done,
+                          u64 *missed)
+{
+    struct kxo_watch_event events[8];
+    int cpus[ARRAY_SIZE(events)];
+    u64 seqs[ARRAY_SIZE(events)];
+    u32 n = 0;
+    int cpu, ret = 0;
+
+    mutex_lock(&w->lock);
+    for_each_possible_cpu(cpu)
+        w->cpus[cpu].peeked = false;
+
+    while (*done + n < room) {
+        struct kxo_watch_cursor *first = NULL;
+        int first_cpu = 0;
+
+    again:
+        for_each_possible_cpu(cpu) {
+            struct kxo_watch_cursor *c = &w->cpus[cpu];
+
+            if (!c->peeked)
+                c->peeked = kxo_watch_peek(per_cpu_ptr(&watch_rings, cpu), c,
+                                           missed);
+            if (c->peeked && (!first || c->next.event.event.time_ns <
+                                            first->next.event.event.time_ns)) {
+                first = c;
+                first_cpu = cpu;
+            }
+        }
+        if (!first)
+            break;
+
+        /* A ring found empty before the first move was peeked may have
+         * received an earlier move of the same game since
+         */
+        for_each_possible_cpu(cpu) {
+            struct kxo_watch_ring *r = per_cpu_ptr(&watch_rings, cpu);
+
+            if (!w->cpus[cpu].peeked &&
+                READ_ONCE(w->cpus[cpu].seq) != smp_load_acquire(&r->head)) {
+                first = NULL;
+                goto again;
+            }
+        }
+
+        first->peeked = false;
+        WRITE_ONCE(first->seq, first->seq + 1);
+        if (!kxo_watch_match(w, &first->next.event, first->next.uid))
+            continue;
+        cpus[n] = first_cpu;
+        seqs[n] = first->seq - 1;
+        events[n++] = first->next.event;
+        if (n < ARRAY_SIZE(events))
+            continue;
+        ret = kxo_watch_flush(w, buf, events, cpus, seqs, n, done);
+        n = 0;
+        if (ret)
+            break;
+    }
+    if (n)
+        ret = kxo_watch_flush(w, buf, events, cpus, seqs, n, done);
+
+    mutex_unlock(&w->lock);
+    return ret;
+}
+
+/* Sleep until a move is played on any CPU past the cursors of w. The
+ * spectator waits on the rings of all CPUs.
+ */
+static int kxo_watch_wait(struct kxo_watcher *w)
+{
+    struct wait_queue_entry *waits;
+    int cpu, ret = 0;
+
+    waits = kmalloc_array(nr_cpu_ids, sizeof(*waits), GFP_KERNEL);
+    if (!waits)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        init_waitqueue_entry(&waits[cpu], current);
+        add_wait_queue(&per_cpu_ptr(&watch_rings, cpu)->wait, &waits[cpu]);
+    }
+
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kxo_watch_pending(w))
+            break;
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+
+    for_each_possible_cpu(cpu)
+        remove_wait_queue(&per_cpu_ptr(&watch_rings, cpu)->wait,
+                          &waits[cpu]);
+    kfree(waits);
+    return ret;
+}
+
+int kxo_watch_read(TidData *tid_data,
+                   bool nonblock,
+                   struct kxo_watch_event __user *buf,
+                   u32 *nr,
+                   u32 *lost)
+{
+    struct kxo_watcher *w = READ_ONCE(tid_data->watcher);
+    u32 room = *nr, done = 0;
+    u64 missed = 0;
+    int ret = 0;
+
+    if (!w)
+        return -EINVAL;
+    if (unlikely(!access_ok(buf, (size_t) room * sizeof(*buf))))
+        return -EFAULT;
+    *lost = 0;
+    if (!room)
+        return 0;
+
+    /* Every move wakes the spectators sleeping then, those of games it does
+     * not watch only advance its cursors
+     */
+    while (!done && !ret) {
+        if (!kxo_watch_pending(w)) {
+            if (nonblock) {
+                ret = -EAGAIN;
+                break;
+            }
+            ret = kxo_watch_wait(w);
+            if (ret)
+                break;
+        }
+        ret = kxo_watch_copy(w, buf, room, &done, &missed);
+        if (nonblock)
+            break;
+    }
+
+    atomic64_add(missed, &lost_moves);
+    *nr = done;
+    *lost = min_t(u64, missed, U32_MAX);
+    return done ? 0 : ret;
+}
+
+__poll_t kxo_watch_poll(TidData *tid_data,
+                        struct file *filp,
+                        struct poll_table_struct *wait)
+{
+    struct kxo_watcher *w = READ_ONCE(tid_data->watcher);
+    int cpu;
+
+    if (!w)
+        return 0;
+    for_each_possible_cpu(cpu)
+        poll_wait(filp, &per_cpu_ptr(&watch_rings, cpu)->wait, wait);
+    if (kxo_watch_pending(w))
+        return EPOLLIN | EPOLLRDNORM;
+    return 0;
+}
+
+void kxo_watch_release(TidData *tid_data)
+{
+    if (!tid_data->watcher)
+        return;
+    atomic_dec(&nr_watchers);
+    kvfree(tid_data->watcher);
+}
+
+static ssize_t spectators_show(struct device *dev,
+                               struct device_attribute *attr,
+                               char *buf)
+{
+    return sysfs_emit(buf, "%d\n", atomic_read(&nr_watchers));
+}
+static DEVICE_ATTR_RO(spectators);
+
+static ssize_t moves_show(struct device *dev,
+                          struct device_attribute *attr,
+                          char *buf)
+{
+    u64 moves = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        moves += smp_load_acquire(&per_cpu_ptr(&watch_rings, cpu)->head);
+    return sysfs_emit(buf, "%llu\n", moves);
+}
+static DEVICE_ATTR_RO(moves);
+
+static ssize_t lost_show(struct device *dev,
+                         struct device_attribute *attr,
+                         char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&lost_moves));
+}
+static DEVICE_ATTR_RO(lost);
+
+static struct attribute *kxo_watch_attrs[] = {
+    &dev_attr_spectators.attr,
+    &dev_attr_moves.attr,
+    &dev_attr_lost.attr,
+    NULL,
+};
+
+const struct attribute_group kxo_watch_group = {
+    .name = "watch",
+    .attrs = kxo_watch_attrs,
+};
@@ -0,0 +1,71 @@
+#ifndef KXO_WATCH_H
+#define KXO_WATCH_H
+
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/sysfs.h>
+
+#include "kxo_ioctl.h"
+#include "type.h"
+
+/* Spectating statistics, a "watch" directory of the device */
+extern const struct attribute_group kxo_watch_group;
+
+// allocate the ring of each CPU, returns 0 or -ENOMEM
+int kxo_watch_init(void);
+void kxo_watch_exit(void);
+
+/**
+ * kxo_watch_publish - Share a move with the spectators.
+ *
+ * @user_data: The game.
+ * @move: The square played, -1 if none.
+ * @player: Who played it.
+ * @win: check_win() after the move.
+ *
+ * Costs one write to the ring of the current CPU whatever the number of
+ * spectators, without a lock, and nothing without any.
+ */
+void kxo_watch_publish(UserData *user_data, int move, char player, char win);
+
+/**
+ * kxo_watch_start - Make a session spectate, or change what it watches.
+ * Games of sessions opened by another user stay hidden, unless the caller
+ * has CAP_SYS_ADMIN.
+ *
+ * @tid_data: The session.
+ * @session_id: Session watched, or KXO_WATCH_ANY.
+ * @game_id: Game of that session watched, or KXO_WATCH_ANY.
+ *
+ * Return: 0 or -ENOMEM.
+ */
+int kxo_watch_start(TidData *tid_data, u32 session_id, u32 game_id);
+
+/**
+ * kxo_watch_read - Read the watched moves played since the last call.
+ *
+ * @tid_data: A spectating session.
+ * @nonblock: Return -EAGAIN rather than wait for a move. Otherwise wait until
+ * a watched move is read, moves of other games do not end the wait.
+ * @buf: Where to copy the moves.
+ * @nr: Room in buf, set to the number of moves copied.
+ * @lost: Set to the number of moves overwritten before they were read.
+ *
+ * Return: 0, -EINVAL if the session does not spectate, -EFAULT, or the
+ * error of an interrupted wait.
+ */
+int kxo_watch_read(TidData *tid_data,
+                   bool nonblock,
+                   struct kxo_watch_event __user *buf,
+                   u32 *nr,
+                   u32 *lost);
+
+// poll() of a session, readable if it spectates and a move was played
+__poll_t kxo_watch_poll(TidData *tid_data,
+                        struct file *filp,
+                        struct poll_table_struct *wait);
+
+// stop spectating, when the session is freed
+void kxo_watch_release(TidData *tid_data);
+
+#endif
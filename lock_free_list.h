@@ -23,15 +23,22 @@ static inline void lf_list_add_head(struct lf_list *head, struct lf_list *node)
     }
 }
 
-static inline struct lf_list *lf_list_remove(struct lf_list *last,
-                                             struct lf_list *node,
-                                             struct lf_list *head)
+/* Unlink node, found after last. Nodes are added concurrently, but only at
+ * the head, and only one thread removes or walks the list at a time.
+ */
+static inline void lf_list_remove(struct lf_list *last,
+                                  struct lf_list *node,
+                                  struct lf_list *head)
 {
-    if (last != head)
-        last->next = node->next;
-    else if (cmpxchg(&head->next, node, node->next) != node)
-        return NULL;
-    return node;
+    while (last == head) {
+        if (cmpxchg(&head->next, node, node->next) == node)
+            return;
+        /* Nodes were added in front of node, find its new predecessor */
+        for (last = READ_ONCE(head->next); last->next != node;
+             last = last->next)
+            ;
+    }
+    WRITE_ONCE(last->next, node->next);
 }
 
 #define lf_list_for_each_safe(now, nxt, head)                \
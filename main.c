@@ -3,6 +3,12 @@
 #include <linux/cdev.h>
 #include <linux/circ_buf.h>
 #include <linux/interrupt.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
 #include <linux/kfifo.h>
 #include <linux/module.h>
 #include <linux/poll.h>
@@ -10,13 +16,19 @@
 #include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/sysfs.h>
-#include <linux/version.h>
 #include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 
 #include "game.h"
+#include "kxo_board.h"
+#include "kxo_budget.h"
+#include "kxo_hybrid.h"
 #include "kxo_ioctl.h"
 #include "kxo_namespace.h"
+#include "kxo_notify.h"
+#include "kxo_ponder.h"
+#include "kxo_sched.h"
+#include "kxo_watch.h"
 #include "mcts.h"
 #include "negamax.h"
 #include "user_data.h"
@@ -25,38 +37,95 @@ MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("National Cheng Kung University, Taiwan");
 MODULE_DESCRIPTION("In-kernel Tic-Tac-Toe game engine");
 
-/* Macro DECLARE_TASKLET_OLD exists for compatibility.
- * See https://lwn.net/Articles/830964/
- */
-#ifndef DECLARE_TASKLET_OLD
-#define DECLARE_TASKLET_OLD(arg1, arg2) DECLARE_TASKLET(arg1, arg2, 0L)
-#endif
-
 #define DEV_NAME "kxo"
 
 #define NR_KMLDRV 1
 
-static int delay = 100; /* time (in ms) to generate an event */
+static int negamax_helpers;
+module_param(negamax_helpers, int, 0444);
+MODULE_PARM_DESC(negamax_helpers,
+                 "Helper threads joining each negamax search (Lazy SMP)");
+
+static int mcts_move(UserData *user_data,
+                     const char *table,
+                     char player,
+                     ktime_t deadline,
+                     ktime_t slice_end,
+                     bool ponder)
+{
+    return mcts(&user_data->mcts, table, player, user_data->tid_data->budget,
+                deadline, slice_end);
+}
 
-static int negamax_move(const char *table, char player)
+static int negamax_move(UserData *user_data,
+                        const char *table,
+                        char player,
+                        ktime_t deadline,
+                        ktime_t slice_end,
+                        bool ponder)
 {
-    negamax_context_t *ctx = kmalloc(sizeof(negamax_context_t), GFP_KERNEL);
-    if (!ctx) {
-        printk("kxo: Failed to allocate negamax_context\n");
-        return -1;
+    /* Kept for the whole game so that its move ordering history carries
+     * over from one move to the next.
+     */
+    if (!user_data->negamax_ctx) {
+        user_data->negamax_ctx =
+            kzalloc_node(sizeof(negamax_context_t),
+                         GFP_KERNEL | __GFP_ACCOUNT,
+                         cpu_to_node(user_data->cpu));
+        if (!user_data->negamax_ctx) {
+            printk("kxo: Failed to allocate negamax_context\n");
+            return -1;
+        }
+        user_data->negamax_ctx->abort = &user_data->unuse;
     }
-    negamax_init(ctx);
+    user_data->negamax_ctx->ponder = ponder;
     char table_copy[16];
     memcpy(table_copy, table, N_GRIDS);
-    return negamax_predict(ctx, table_copy, player).move;
+    return negamax_predict(user_data->negamax_ctx, table_copy, player, deadline,
+                           slice_end)
+        .move;
+}
+
+static int hybrid_move(UserData *user_data,
+                       const char *table,
+                       char player,
+                       ktime_t deadline,
+                       ktime_t slice_end,
+                       bool ponder)
+{
+    struct kxo_hybrid *hybrid = &user_data->hybrid;
+    ktime_t start = ktime_get();
+    int move, progress = 0;
+
+    switch (kxo_hybrid_pick(hybrid, table, player, deadline)) {
+    case KXO_METHOD_BOOK:
+    case KXO_METHOD_FORCED:
+        move = hybrid->move;
+        break;
+    case KXO_METHOD_SOLVE:
+    case KXO_METHOD_NEGAMAX:
+        /* A solve searches to the end of the game, past the deadline */
+        move = negamax_move(user_data, table, player,
+                            hybrid->method == KXO_METHOD_SOLVE ? KTIME_MAX
+                                                               : deadline,
+                            slice_end, ponder);
+        if (user_data->negamax_ctx)
+            progress = user_data->negamax_ctx->depth;
+        break;
+    default:
+        move = mcts_move(user_data, table, player, deadline, slice_end,
+                         ponder);
+        progress = user_data->mcts.iterations;
+        break;
+    }
+    kxo_hybrid_done(hybrid, ktime_to_ns(ktime_sub(ktime_get(), start)), move,
+                    progress, ponder);
+    return move;
 }
 
 
 /* Data produced by the simulated device */
 
-/* Timer to simulate a periodic IRQ */
-static struct timer_list timer;
-
 /* Character device stuff */
 static int major;
 static struct class *kxo_class;
@@ -77,80 +146,423 @@ static void fast_buf_clear(void)
 
 static int finish;
 
-/* Workqueue for asynchronous bottom-half processing */
-static struct workqueue_struct *kxo_workqueue;
+ai_func_t alg_list[] = {NULL, &mcts_move, &negamax_move, &hybrid_move};
+
+/* Create a game, both ABI versions */
+static int kxo_new_game(TidData *tid_data,
+                        unsigned int p1,
+                        unsigned int p2,
+                        u32 max_id,
+                        u32 *id)
+{
+    if (p1 >= ARRAY_SIZE(alg_list) || p2 >= ARRAY_SIZE(alg_list))
+        return -EINVAL;
+    return add_user(tid_data, alg_list[p1], alg_list[p2], max_id, id);
+}
+
+static int kxo_set_pace(TidData *tid_data, u32 game_id, unsigned int pace_us)
+{
+    UserData *user_data = get_user_data(tid_data, game_id);
+    if (!user_data)
+        return -EINVAL;
+    kxo_sched_set_pace(user_data, pace_us);
+    return 0;
+}
 
-/* Tasklet handler.
- *
- * NOTE: different tasklets can run concurrently on different processors, but
- * two of the same type of tasklet cannot run simultaneously. Moreover, a
- * tasklet always runs on the same CPU that schedules it.
+static int kxo_set_qos(TidData *tid_data, u32 game_id, unsigned int qos)
+{
+    UserData *user_data = get_user_data(tid_data, game_id);
+    if (!user_data || qos >= NR_KXO_QOS)
+        return -EINVAL;
+    WRITE_ONCE(user_data->qos, qos);
+    return 0;
+}
+
+/* Play the move of the userspace player of a game, and encode it in
+ * *result like the moves read from the game. Returns -EAGAIN if nonblock is
+ * set and another play of the game is in progress.
  */
-static void game_tasklet_func(unsigned long __data)
+static int kxo_play(TidData *tid_data,
+                    u32 game_id,
+                    unsigned int move,
+                    unsigned char *result,
+                    bool nonblock)
 {
-    ktime_t tv_start, tv_end;
-    s64 nsecs;
+    UserData *user_data = get_user_data(tid_data, game_id);
+    int ret = 0;
 
-    WARN_ON_ONCE(!in_interrupt());
-    WARN_ON_ONCE(!in_softirq());
+    if (!user_data)
+        return -EFAULT;
 
-    tv_start = ktime_get();
+    /* Threads sharing the file, or io_uring workers running a batch, may
+     * play the same game at once. Each checks the position the previous one
+     * left, the engines and the pondering wait as well.
+     */
+    if (nonblock) {
+        if (!mutex_trylock(&user_data->search_lock))
+            return -EAGAIN;
+    } else if (mutex_lock_interruptible(&user_data->search_lock)) {
+        return -EINTR;
+    }
 
-    user_list_queue_work(kxo_workqueue);
+    if (get_turn_function(user_data) != NULL || move >= 16 ||
+        user_data->table[move] != ' ') {
+        ret = -EPERM;
+        goto out;
+    }
+    WRITE_ONCE(user_data->table[move], user_data->turn);
 
-    tv_end = ktime_get();
+    WRITE_ONCE(move, (user_data->turn == 'X') << 4 | move);
 
-    nsecs = (s64) ktime_to_ns(ktime_sub(tv_end, tv_start));
+    char win;
+    WRITE_ONCE(win, check_win(user_data->table));
+    kxo_watch_publish(user_data, move & 0x0f, user_data->turn, win);
 
-    pr_info("kxo: [CPU#%d] %s in_softirq: %llu usec\n", smp_processor_id(),
-            __func__, (unsigned long long) nsecs >> 10);
+    if (win != ' ') {
+        move |= 1 << 5;
+        move |= (win == 'D') << 6;
+        kxo_board_update(user_data, win);
+        reset_user_data_table(user_data);
+    } else {
+        WRITE_ONCE(user_data->turn, user_data->turn ^ 'O' ^ 'X');
+        kxo_board_update(user_data, win);
+    }
+
+    kxo_sched_game_ready(user_data);
+    *result = move;
+
+out:
+    mutex_unlock(&user_data->search_lock);
+    return ret;
 }
 
-/* Tasklet for asynchronous bottom-half processing in softirq context */
-static DECLARE_TASKLET_OLD(game_tasklet, game_tasklet_func);
+/* After taking moves from a game. Unmark it before looking, a move produced
+ * meanwhile marks it again.
+ */
+static void kxo_game_consumed(TidData *tid_data, UserData *user_data)
+{
+    if (kfifo_is_empty(&user_data->user_fifo)) {
+        xa_clear_mark(&tid_data->games, user_data->id, KXO_GAME_READABLE);
+        if (!kfifo_is_empty(&user_data->user_fifo))
+            xa_set_mark(&tid_data->games, user_data->id, KXO_GAME_READABLE);
+    }
+    kxo_sched_game_drained(user_data);
+}
 
-static void ai_game(void)
+/* Fifos have a single reader: threads of the session and io_uring workers
+ * reading moves at once take turns
+ */
+static int kxo_lock_reader(TidData *tid_data, bool nonblock)
 {
-    WARN_ON_ONCE(!irqs_disabled());
+    if (nonblock)
+        return mutex_trylock(&tid_data->read_lock) ? 0 : -EAGAIN;
+    return mutex_lock_interruptible(&tid_data->read_lock) ? -EINTR : 0;
+}
 
-    pr_info("kxo: [CPU#%d] doing AI game\n", smp_processor_id());
-    pr_info("kxo: [CPU#%d] scheduling tasklet\n", smp_processor_id());
-    tasklet_schedule(&game_tasklet);
+/* Encoding of a move by read() */
+static unsigned char kxo_event_code(const struct kxo_event *event)
+{
+    return event->move | (event->player == 'X') << 4 |
+           !!event->flags << 5 | !!(event->flags & KXO_EVENT_DRAW) << 6;
+}
+
+/* Take up to count moves of a game to buf, in the encoding of read(). Moves
+ * that could not be copied stay in the fifo.
+ */
+static ssize_t kxo_copy_moves(UserData *user_data,
+                              char __user *buf,
+                              size_t count)
+{
+    struct kxo_event events[16];
+    unsigned char codes[ARRAY_SIZE(events)];
+    size_t copied = 0;
+
+    while (copied < count) {
+        unsigned int n = peek_events(
+            user_data, events,
+            min_t(size_t, count - copied, ARRAY_SIZE(events)));
+        if (!n)
+            break;
+        for (int i = 0; i < n; i++)
+            codes[i] = kxo_event_code(&events[i]);
+        /* Left in the fifo for the next read */
+        if (copy_to_user(buf + copied, codes, n))
+            return copied ? copied : -EFAULT;
+        drop_events(user_data, n);
+        copied += n;
+    }
+    return copied;
 }
 
-static void timer_handler(struct timer_list *__timer)
+/* Read the moves of one game, both ABI versions */
+static ssize_t kxo_read_game(struct file *file,
+                             u32 game_id,
+                             char __user *buf,
+                             size_t count)
 {
-    ktime_t tv_start, tv_end;
-    s64 nsecs;
+    TidData *tid_data = file->private_data;
+    UserData *user_data = get_user_data(tid_data, game_id);
 
-    pr_info("kxo: [CPU#%d] enter %s\n", smp_processor_id(), __func__);
-    /* We are using a kernel timer to simulate a hard-irq, so we must expect
-     * to be in softirq context here.
-     */
-    WARN_ON_ONCE(!in_softirq());
+    if (!user_data)
+        return -EFAULT;
+    if (get_turn_function(user_data) == NULL)
+        return -EPERM;
+
+    ssize_t read;
+    int ret;
+
+    pr_debug("kxo: %s(%u, %p, %zd)\n", __func__, game_id, buf, count);
+
+    if (unlikely(!access_ok(buf, count)))
+        return -EFAULT;
+
+    do {
+        ret = kxo_lock_reader(tid_data, file->f_flags & O_NONBLOCK);
+        if (ret)
+            break;
+        read = kxo_copy_moves(user_data, buf, count);
+        if (read)
+            kxo_game_consumed(tid_data, user_data);
+        mutex_unlock(&tid_data->read_lock);
+        if (read)
+            return read;
+        if (file->f_flags & O_NONBLOCK) {
+            ret = -EAGAIN;
+            break;
+        }
+        pr_info("kxo: read_wait");
+        ret = wait_event_interruptible(user_data->tid_data->tid_wait,
+                                       kfifo_len(&user_data->user_fifo));
+    } while (ret == 0);
 
-    /* Disable interrupts for this CPU to simulate real interrupt context */
-    local_irq_disable();
+    return ret;
+}
 
-    tv_start = ktime_get();
+/* Drain the moves of all the games of a session into buf, at most *nr of
+ * them, and set *nr to the number read. Games are visited round robin from
+ * where the previous call ran out of room, each at most once.
+ */
+static int kxo_read_events(TidData *tid_data,
+                           bool nonblock,
+                           struct kxo_event __user *buf,
+                           u32 *nr)
+{
+    struct kxo_event events[16];
+    u32 room = *nr, done = 0;
+    int ret = 0;
 
-    ai_game();
-    mod_timer(&timer, jiffies + msecs_to_jiffies(delay));
-    tv_end = ktime_get();
+    if (unlikely(!access_ok(buf, (size_t) room * sizeof(*buf))))
+        return -EFAULT;
 
-    nsecs = (s64) ktime_to_ns(ktime_sub(tv_end, tv_start));
+    while (!xa_marked(&tid_data->games, KXO_GAME_READABLE)) {
+        if (nonblock)
+            return -EAGAIN;
+        ret = wait_event_interruptible(
+            tid_data->tid_wait,
+            xa_marked(&tid_data->games, KXO_GAME_READABLE));
+        if (ret)
+            return ret;
+    }
 
-    pr_info("kxo: [CPU#%d] %s in_irq: %llu usec\n", smp_processor_id(),
-            __func__, (unsigned long long) nsecs >> 10);
+    ret = kxo_lock_reader(tid_data, nonblock);
+    if (ret)
+        return ret;
+
+    unsigned long start = tid_data->read_cursor, id = start;
+    unsigned long last = ULONG_MAX;
+    UserData *user_data =
+        xa_find(&tid_data->games, &id, last, KXO_GAME_READABLE);
 
-    local_irq_enable();
+    while (done < room) {
+        if (!user_data) {
+            /* Wrap around to the games before start */
+            if (last != ULONG_MAX || !start)
+                break;
+            last = start - 1;
+            id = 0;
+            user_data =
+                xa_find(&tid_data->games, &id, last, KXO_GAME_READABLE);
+            continue;
+        }
+
+        u32 want = min_t(u32, room - done, ARRAY_SIZE(events));
+        u32 got = peek_events(user_data, events, want);
+        if (got && copy_to_user(buf + done, events, got * sizeof(*events))) {
+            ret = -EFAULT;
+            break;
+        }
+        drop_events(user_data, got);
+        done += got;
+        if (got == want)
+            continue;
+
+        kxo_game_consumed(tid_data, user_data);
+        user_data =
+            xa_find_after(&tid_data->games, &id, last, KXO_GAME_READABLE);
+    }
+    /* Out of room, the next call starts after the game that filled it */
+    if (done == room && user_data)
+        tid_data->read_cursor = id + 1;
+    mutex_unlock(&tid_data->read_lock);
+
+    *nr = done;
+    return done ? 0 : ret;
 }
 
-ai_func_t alg_list[] = {NULL, &mcts, &negamax_move};
+static long kxo_ioctl_v2(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    TidData *tid_data = filp->private_data;
+    void __user *argp = (void __user *) arg;
+    int ret;
+
+    switch (cmd) {
+    case KXO_IOC_VERSION:
+        return put_user((__u32) KXO_ABI_VERSION, (__u32 __user *) argp);
+    case KXO_IOC_NEW_GAME: {
+        struct kxo_new_game game;
+        if (copy_from_user(&game, argp, sizeof(game)))
+            return -EFAULT;
+        ret = kxo_new_game(tid_data, game.player1, game.player2, U32_MAX,
+                           &game.game_id);
+        if (ret)
+            return ret;
+        if (copy_to_user(argp, &game, sizeof(game)))
+            return -EFAULT;
+        return 0;
+    }
+    case KXO_IOC_SET_PACE: {
+        struct kxo_game_pace pace;
+        if (copy_from_user(&pace, argp, sizeof(pace)))
+            return -EFAULT;
+        return kxo_set_pace(tid_data, pace.game_id, pace.pace_us);
+    }
+    case KXO_IOC_SET_QOS: {
+        struct kxo_game_qos qos;
+        if (copy_from_user(&qos, argp, sizeof(qos)))
+            return -EFAULT;
+        return kxo_set_qos(tid_data, qos.game_id, qos.qos);
+    }
+    case KXO_IOC_PLAY: {
+        struct kxo_play play;
+        if (copy_from_user(&play, argp, sizeof(play)))
+            return -EFAULT;
+        ret = kxo_play(tid_data, play.game_id, play.move, &play.result,
+                       false);
+        if (ret)
+            return ret;
+        if (copy_to_user(argp, &play, sizeof(play)))
+            return -EFAULT;
+        return 0;
+    }
+    case KXO_IOC_READ: {
+        struct kxo_read rd;
+        if (copy_from_user(&rd, argp, sizeof(rd)))
+            return -EFAULT;
+        return kxo_read_game(filp, rd.game_id, u64_to_user_ptr(rd.buf),
+                             rd.len);
+    }
+    case KXO_IOC_READ_EVENTS: {
+        struct kxo_read_events rd;
+        if (copy_from_user(&rd, argp, sizeof(rd)))
+            return -EFAULT;
+        ret = kxo_read_events(tid_data, filp->f_flags & O_NONBLOCK,
+                              u64_to_user_ptr(rd.buf), &rd.nr);
+        if (ret)
+            return ret;
+        if (put_user(rd.nr, &((struct kxo_read_events __user *) argp)->nr))
+            return -EFAULT;
+        return 0;
+    }
+    case KXO_IOC_FETCH_READY: {
+        struct kxo_ready ready;
+        if (copy_from_user(&ready, argp, sizeof(ready)))
+            return -EFAULT;
+        return kxo_notify_fetch_ready(tid_data, u64_to_user_ptr(ready.buf),
+                                      ready.first, ready.nr_words);
+    }
+    case KXO_IOC_SESSION_ID:
+        return put_user(tid_data->session_id, (__u32 __user *) argp);
+    case KXO_IOC_WATCH: {
+        struct kxo_watch watch;
+        if (copy_from_user(&watch, argp, sizeof(watch)))
+            return -EFAULT;
+        return kxo_watch_start(tid_data, watch.session_id, watch.game_id);
+    }
+    case KXO_IOC_WATCH_READ: {
+        struct kxo_watch_read rd;
+        if (copy_from_user(&rd, argp, sizeof(rd)))
+            return -EFAULT;
+        ret = kxo_watch_read(tid_data, filp->f_flags & O_NONBLOCK,
+                             u64_to_user_ptr(rd.buf), &rd.nr, &rd.lost);
+        if (ret)
+            return ret;
+        if (copy_to_user(argp, &rd, sizeof(rd)))
+            return -EFAULT;
+        return 0;
+    }
+    case KXO_IOC_SET_EVENTFD: {
+        struct kxo_eventfd efd;
+        if (copy_from_user(&efd, argp, sizeof(efd)))
+            return -EFAULT;
+        if (efd.flags & ~KXO_EVENTFD_SESSION)
+            return -EINVAL;
+        return kxo_notify_set_eventfd(tid_data,
+                                      efd.flags & KXO_EVENTFD_SESSION,
+                                      efd.game_id, efd.fd);
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/* io_uring passthrough of the v2 commands that batch well. Each completes
+ * with its result in the CQE. A read of events that would block is retried
+ * by io_uring from one of its workers, where it may sleep.
+ */
+static int kxo_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    TidData *tid_data = ioucmd->file->private_data;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    const void *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+    const void *cmd = ioucmd->cmd;
+#endif
+    int ret;
+
+    switch (ioucmd->cmd_op) {
+    case KXO_IOC_PLAY: {
+        const struct kxo_play *play = cmd;
+        unsigned char result;
+        /* Waiting for another play of the game is left to io-wq */
+        ret = kxo_play(tid_data, READ_ONCE(play->game_id),
+                       READ_ONCE(play->move), &result,
+                       issue_flags & IO_URING_F_NONBLOCK);
+        return ret ? ret : result;
+    }
+    case KXO_IOC_READ_EVENTS: {
+        const struct kxo_read_events *rd = cmd;
+        bool nonblock = (issue_flags & IO_URING_F_NONBLOCK) ||
+                        (ioucmd->file->f_flags & O_NONBLOCK);
+        u32 nr = READ_ONCE(rd->nr);
+        ret = kxo_read_events(tid_data, nonblock,
+                              u64_to_user_ptr(READ_ONCE(rd->buf)), &nr);
+        return ret ? ret : nr;
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+#endif
 
 static long kxo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+    TidData *tid_data = filp->private_data;
     int ret = 0;
+
+    if (_IOC_TYPE(cmd) == KXO_IOC_MAGIC)
+        return kxo_ioctl_v2(filp, cmd, arg);
+
     switch (cmd) {
     case GET_USER_ID:
         char data;
@@ -161,11 +573,10 @@ static long kxo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         unsigned char p1 = data >> 4;
         unsigned char p2 = data & 0x0f;
 
-        int user_id = add_user(current->pid, alg_list[p1], alg_list[p2]);
-        if (user_id == -1) {
-            ret = -ENOMEM;
+        u32 user_id;
+        ret = kxo_new_game(tid_data, p1, p2, U8_MAX, &user_id);
+        if (ret)
             goto error;
-        }
 
         data = (unsigned char) user_id;
 
@@ -175,6 +586,24 @@ static long kxo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         }
 
         break;
+    case SET_PACE: {
+        struct kxo_pace pace;
+        if (copy_from_user(&pace, (void __user *) arg, sizeof(pace))) {
+            ret = -EFAULT;
+            goto error;
+        }
+        ret = kxo_set_pace(tid_data, pace.user_id, pace.pace_us);
+        break;
+    }
+    case SET_QOS: {
+        struct kxo_qos qos;
+        if (copy_from_user(&qos, (void __user *) arg, sizeof(qos))) {
+            ret = -EFAULT;
+            goto error;
+        }
+        ret = kxo_set_qos(tid_data, qos.user_id, qos.qos);
+        break;
+    }
     default:
         break;
     }
@@ -183,85 +612,35 @@ error:
     return ret;
 }
 
+/* Version 1 read: the first byte of buf is the id of the game */
 static ssize_t kxo_read(struct file *file,
                         char __user *buf,
                         size_t count,
                         loff_t *ppos)
 {
-    TidData *tid_data = find_tid_data(current->pid);
-    pr_info("kxo: tid %d's tid_data_ptr: %p\n", current->pid, tid_data);
-
     unsigned char user_id;
     if (copy_from_user(&user_id, (char __user *) buf, sizeof(user_id)))
         return -EFAULT;
-    UserData *user_data = get_user_data(current->pid, user_id);
-
-    if (!user_data)
-        return -EFAULT;
-    if (get_turn_function(user_data) == NULL)
-        return -EPERM;
-
-    unsigned int read;
-    int ret;
-
-    pr_debug("kxo: %s(%p, %zd, %lld)\n", __func__, buf, count, *ppos);
-
-    if (unlikely(!access_ok(buf, count)))
-        return -EFAULT;
-
-    do {
-        ret = kfifo_to_user(&user_data->user_fifo, buf, count, &read);
-        if (unlikely(ret < 0))
-            break;
-        if (read)
-            break;
-        if (file->f_flags & O_NONBLOCK) {
-            ret = -EAGAIN;
-            break;
-        }
-        pr_info("kxo: read_wait");
-        ret = wait_event_interruptible(user_data->tid_data->tid_wait,
-                                       kfifo_len(&user_data->user_fifo));
-    } while (ret == 0);
-
-    return ret ? ret : read;
+    return kxo_read_game(file, user_id, buf, count);
 }
 
+/* Version 1 write: the id of the game, then the move in the low nibble of
+ * the next byte. The first byte is overwritten with the encoded move.
+ */
 static ssize_t kxo_write(struct file *file,
                          const char __user *buff,
                          size_t len,
                          loff_t *off)
 {
-    TidData *tid_data = find_tid_data(current->pid);
-    pr_info("kxo: tid %d's tid_data_ptr: %p\n", current->pid, tid_data);
-
     short int data;
     if (copy_from_user(&data, buff, 2))
         return -EFAULT;
     unsigned char user_id = data & 0xff;
     unsigned char move = (data >> 8) & 0xf;
 
-    UserData *user_data = get_user_data(current->pid, user_id);
-
-    if (!user_data)
-        return -EFAULT;
-    if (get_turn_function(user_data) != NULL)
-        return -EPERM;
-    if (move >= 16 || user_data->table[move] != ' ')
-        return -EPERM;
-    WRITE_ONCE(user_data->table[move], user_data->turn);
-
-    WRITE_ONCE(move, (user_data->turn == 'X') << 4 | move);
-
-    char win;
-    WRITE_ONCE(win, check_win(user_data->table));
-
-    if (win != ' ') {
-        move |= 1 << 5;
-        move |= (win == 'D') << 6;
-        reset_user_data_table(user_data);
-    } else
-        WRITE_ONCE(user_data->turn, user_data->turn ^ 'O' ^ 'X');
+    int ret = kxo_play(file->private_data, user_id, move, &move, false);
+    if (ret)
+        return ret;
 
     if (copy_to_user(buff, &move, sizeof(move)))
         return -EFAULT;
@@ -270,22 +649,30 @@ static ssize_t kxo_write(struct file *file,
     return 0;
 }
 
-static __poll_t kxo_poll(struct file *filp, struct poll_table_struct *wait)
+static int kxo_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-    __poll_t mask = 0;
-    TidData *tid_data = find_tid_data(current->pid);
-    poll_wait(filp, &tid_data->tid_wait, wait);
+    TidData *tid_data = filp->private_data;
 
-    for (int i = 0; i < USER_MAX; i++) {
-        if (tid_data->user_data_list[i] != NULL) {
-            UserData *user_data = tid_data->user_data_list[i];
-            if (kfifo_len(&user_data->user_fifo)) {
-                mask |= EPOLLRDNORM | EPOLLIN;
-                break;
-            }
-        }
+    switch (vma->vm_pgoff << PAGE_SHIFT) {
+    case KXO_MMAP_EVENTS:
+        return kxo_ring_mmap(&tid_data->ring, vma);
+    case KXO_MMAP_BOARDS:
+        return kxo_board_mmap(tid_data, vma);
+    default:
+        return -EINVAL;
     }
+}
+
+static __poll_t kxo_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    TidData *tid_data = filp->private_data;
 
+    __poll_t mask = kxo_watch_poll(tid_data, filp, wait);
+
+    poll_wait(filp, &tid_data->tid_wait, wait);
+    if (xa_marked(&tid_data->games, KXO_GAME_READABLE) ||
+        kxo_ring_readable(READ_ONCE(tid_data->ring)))
+        mask |= EPOLLRDNORM | EPOLLIN;
     return mask;
 }
 
@@ -293,12 +680,14 @@ static atomic_t open_cnt;
 
 static int kxo_open(struct inode *inode, struct file *filp)
 {
-    int result = add_tid_data(current->pid);
-    pr_info("kxo: tid %d open kxo, result: %d\n", current->pid, result);
+    TidData *tid_data = add_tid_data(current->pid);
+    pr_info("kxo: tid %d open kxo, session: %p\n", current->pid, tid_data);
+    if (!tid_data)
+        return -ENOMEM;
+    filp->private_data = tid_data;
 
     pr_debug("kxo: %s\n", __func__);
-    if (atomic_inc_return(&open_cnt) == 1)
-        mod_timer(&timer, jiffies + msecs_to_jiffies(delay));
+    atomic_inc(&open_cnt);
     pr_info("openm current cnt: %d\n", atomic_read(&open_cnt));
 
     return 0;
@@ -306,14 +695,14 @@ static int kxo_open(struct inode *inode, struct file *filp)
 
 static int kxo_release(struct inode *inode, struct file *filp)
 {
-    int result = delete_tid_data(current->pid);
-    pr_info("kxo: tid %d close kxo, result: %d\n", current->pid, result);
+    TidData *tid_data = filp->private_data;
+    pr_info("kxo: tid %d close kxo, session of tid %d\n", current->pid,
+            tid_data->tid);
+    delete_tid_data(tid_data);
     pr_debug("kxo: %s\n", __func__);
-    if (atomic_dec_and_test(&open_cnt)) {
-        del_timer_sync(&timer);
-        flush_workqueue(kxo_workqueue);
+    kxo_sched_reap();
+    if (atomic_dec_and_test(&open_cnt))
         fast_buf_clear();
-    }
     pr_info("release, current cnt: %d\n", atomic_read(&open_cnt));
 
     return 0;
@@ -331,8 +720,24 @@ static const struct file_operations kxo_fops = {
     .open = kxo_open,
     .release = kxo_release,
     .unlocked_ioctl = kxo_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    .uring_cmd = kxo_uring_cmd,
+#endif
+    .mmap = kxo_mmap,
     .poll = kxo_poll};
 
+static const struct attribute_group *kxo_groups[] = {
+    &kxo_sched_group,
+    &kxo_interactive_group,
+    &kxo_background_group,
+    &kxo_budget_group,
+    &kxo_ponder_group,
+    &kxo_hybrid_group,
+    &kxo_notify_group,
+    &kxo_watch_group,
+    NULL,
+};
+
 static char *kxo_devnode(const struct device *dev, umode_t *mode)
 {
     if (mode)
@@ -345,13 +750,21 @@ static int __init kxo_init(void)
     dev_t dev_id;
     int ret;
 
-    init_namespace();
+    ret = init_namespace();
+    if (ret)
+        return ret;
     mcts_init();
+    ret = negamax_init(negamax_helpers);
+    if (ret)
+        goto error_namespace;
+    ret = kxo_watch_init();
+    if (ret)
+        goto error_negamax;
 
     /* Register major/minor numbers */
     ret = alloc_chrdev_region(&dev_id, 0, NR_KMLDRV, DEV_NAME);
     if (ret)
-        goto out;
+        goto error_watch;
     major = MAJOR(dev_id);
 
     /* Add the character device to the system */
@@ -376,7 +789,8 @@ static int __init kxo_init(void)
     }
 
     /* Register the device with sysfs */
-    device_create(kxo_class, NULL, MKDEV(major, 0), NULL, DEV_NAME);
+    device_create_with_groups(kxo_class, NULL, MKDEV(major, 0), NULL,
+                              kxo_groups, DEV_NAME);
 
     /* Allocate fast circular buffer */
     fast_buf.buf = vmalloc(PAGE_SIZE);
@@ -385,21 +799,16 @@ static int __init kxo_init(void)
         goto error_vmalloc;
     }
 
-    /* Create the workqueue */
-    kxo_workqueue = alloc_workqueue("kxod", WQ_CPU_INTENSIVE, WQ_MAX_ACTIVE);
-    if (!kxo_workqueue) {
-        ret = -ENOMEM;
-        goto error_workqueue;
-    }
+    ret = kxo_sched_init();
+    if (ret)
+        goto error_sched;
 
-    /* Setup the timer */
-    timer_setup(&timer, timer_handler, 0);
     atomic_set(&open_cnt, 0);
 
     pr_info("kxo: registered new kxo device: %d,%d\n", major, 0);
 out:
     return ret;
-error_workqueue:
+error_sched:
     vfree(fast_buf.buf);
 error_vmalloc:
     device_destroy(kxo_class, dev_id);
@@ -408,6 +817,12 @@ error_cdev:
     cdev_del(&kxo_cdev);
 error_region:
     unregister_chrdev_region(dev_id, NR_KMLDRV);
+error_watch:
+    kxo_watch_exit();
+error_negamax:
+    negamax_exit();
+error_namespace:
+    release_namespace();
     goto out;
 }
 
@@ -415,10 +830,7 @@ static void __exit kxo_exit(void)
 {
     dev_t dev_id = MKDEV(major, 0);
 
-    del_timer_sync(&timer);
-    tasklet_kill(&game_tasklet);
-    flush_workqueue(kxo_workqueue);
-    destroy_workqueue(kxo_workqueue);
+    kxo_sched_exit();
     vfree(fast_buf.buf);
     device_destroy(kxo_class, dev_id);
     class_destroy(kxo_class);
@@ -426,6 +838,8 @@ static void __exit kxo_exit(void)
     unregister_chrdev_region(dev_id, NR_KMLDRV);
 
     release_namespace();
+    kxo_watch_exit();
+    negamax_exit();
     pr_info("kxo: unloaded\n");
 }
 
@@ -16,9 +16,17 @@ struct node {
 
 static struct mcts_info mcts_obj;
 
-static struct node *new_node(int move, char player, struct node *parent)
+/* Check the deadline once every this many iterations */
+#define MCTS_TIME_CHECK_MASK 0xff
+
+static struct node *new_node(struct kxo_budget *budget,
+                             int move,
+                             char player,
+                             struct node *parent)
 {
-    struct node *node = kzalloc(sizeof(struct node), GFP_KERNEL);
+    struct node *node = kxo_budget_alloc(budget, sizeof(struct node));
+    if (!node)
+        return NULL;
     node->move = move;
     node->player = player;
     node->n_visits = 0;
@@ -28,12 +36,12 @@ static struct node *new_node(int move, char player, struct node *parent)
     return node;
 }
 
-static void free_node(struct node *node)
+static void free_node(struct kxo_budget *budget, struct node *node)
 {
     for (int i = 0; i < N_GRIDS; i++)
         if (node->children[i])
-            free_node(node->children[i]);
-    kfree(node);
+            free_node(budget, node->children[i]);
+    kxo_budget_free(budget, node, sizeof(struct node));
 }
 
 static fixed_point_t fixed_sqrt(fixed_point_t x)
@@ -156,25 +164,83 @@ static void backpropagate(struct node *node, fixed_point_t score)
     }
 }
 
-static int expand(struct node *node, const char *table)
+static int expand(struct kxo_budget *budget,
+                  struct node *node,
+                  const char *table)
 {
     int *moves = available_moves(table);
     int n_moves = 0;
     while (n_moves < N_GRIDS && moves[n_moves] != -1)
         ++n_moves;
     for (int i = 0; i < n_moves; i++) {
-        node->children[i] = new_node(moves[i], node->player ^ 'O' ^ 'X', node);
+        node->children[i] =
+            new_node(budget, moves[i], node->player ^ 'O' ^ 'X', node);
+        if (!node->children[i]) {
+            n_moves = i;
+            break;
+        }
     }
     kfree(moves);
     return n_moves;
 }
 
-int mcts(const char *table, char player)
+static int any_move(const char *table)
+{
+    for (int i = 0; i < N_GRIDS; i++)
+        if (table[i] == ' ')
+            return i;
+    return -1;
+}
+
+void mcts_release(struct mcts_search *search, struct kxo_budget *budget)
+{
+    if (!search->root)
+        return;
+    free_node(budget, search->root);
+    search->root = NULL;
+}
+
+int mcts(struct mcts_search *search,
+         const char *table,
+         char player,
+         struct kxo_budget *budget,
+         ktime_t deadline,
+         ktime_t slice_end)
 {
     char win;
-    struct node *root = new_node(-1, player, NULL);
-    mcts_obj.nr_active_nodes = 1;
-    for (int i = 0; i < ITERATIONS; i++) {
+
+    /* A suspended search of another position is of no use */
+    if (search->root &&
+        (search->player != player || memcmp(search->table, table, N_GRIDS)))
+        mcts_release(search, budget);
+    if (!search->root) {
+        search->root = new_node(budget, -1, player, NULL);
+        if (!search->root) {
+            search->iterations = 0;
+            return any_move(table);
+        }
+        memcpy(search->table, table, N_GRIDS);
+        search->player = player;
+        search->iterations = 0;
+        mcts_obj.nr_active_nodes = 1;
+    }
+
+    struct node *root = search->root;
+    int i;
+    for (i = search->iterations; i < ITERATIONS; i++) {
+        if (!(i & MCTS_TIME_CHECK_MASK) && i != search->iterations) {
+            ktime_t now = ktime_get();
+            if (READ_ONCE(*search->abort)) {
+                mcts_release(search, budget);
+                return -1;
+            }
+            if (ktime_after(now, deadline))
+                break;
+            if (ktime_after(now, slice_end)) {
+                search->iterations = i;
+                return SEARCH_YIELD;
+            }
+        }
         struct node *node = root;
         char temp_table[N_GRIDS];
         memcpy(temp_table, table, N_GRIDS);
@@ -191,13 +257,15 @@ int mcts(const char *table, char player)
                 break;
             }
             if (node->children[0] == NULL)
-                mcts_obj.nr_active_nodes += expand(node, temp_table);
+                mcts_obj.nr_active_nodes += expand(budget, node, temp_table);
             node = select_move(node);
             if (!node)
-                return -1;
+                goto out; /* no child, out of search memory */
             temp_table[node->move] = node->player ^ 'O' ^ 'X';
         }
     }
+out:
+    search->iterations = i;
     struct node *best_node = root;
     int most_visits = -1;
     for (int i = 0; i < N_GRIDS; i++) {
@@ -206,8 +274,9 @@ int mcts(const char *table, char player)
             best_node = root->children[i];
         }
     }
-    int best_move = best_node->move;
-    free_node(root);
+    /* Out of search memory before the root could be expanded */
+    int best_move = best_node == root ? any_move(table) : best_node->move;
+    mcts_release(search, budget);
     return best_move;
 }
 
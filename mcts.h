@@ -1,5 +1,9 @@
 #pragma once
 
+#include <linux/ktime.h>
+
+#include "game.h"
+#include "kxo_budget.h"
 #include "xoroshiro.h"
 
 #define ITERATIONS 100000
@@ -9,5 +13,29 @@ struct mcts_info {
     int nr_active_nodes;
 };
 
-int mcts(const char *table, char player);
+struct node;
+
+/* Search kept by a game between time slices */
+struct mcts_search {
+    struct node *root;  // NULL when no search is suspended
+    char table[N_GRIDS];
+    char player;
+    int iterations;
+    const char *abort;  // the search stops as soon as it is set
+};
+
+/* Stops after ITERATIONS iterations or at the deadline, returns SEARCH_YIELD
+ * at slice_end if that comes first and -1 once search->abort is set. Tree
+ * nodes are allocated from the search memory budget, the tree stops growing
+ * when it is spent. Once the move is found, search->iterations holds the
+ * iterations it took, over all the slices.
+ */
+int mcts(struct mcts_search *search,
+         const char *table,
+         char player,
+         struct kxo_budget *budget,
+         ktime_t deadline,
+         ktime_t slice_end);
+// free a suspended search
+void mcts_release(struct mcts_search *search, struct kxo_budget *budget);
 void mcts_init(void);
@@ -1,13 +1,48 @@
+#include <linux/kthread.h>
 #include <linux/slab.h>
-#include <linux/sort.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
+#include <linux/wait.h>
 
 #include "game.h"
 #include "negamax.h"
 #include "util.h"
 #include "zobrist.h"
 
-#define MAX_SEARCH_DEPTH 6
+#define SCORE_INF 100000
+#define ASPIRATION_WINDOW 32
+
+/* Read the clock once every (TIME_CHECK_MASK + 1) nodes */
+#define TIME_CHECK_MASK 0xff
+
+/* Root search the helper threads join. A new generation is published for
+ * every search and again when it ends, which is what stops the helpers.
+ */
+static struct {
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    unsigned int generation;
+    bool active;
+    char table[N_GRIDS];
+    char player;
+    ktime_t deadline;
+    int depth; /* iteration of the main thread */
+} smp_job;
+
+struct negamax_helper {
+    struct task_struct *task;
+    negamax_context_t ctx;
+};
+
+static struct negamax_helper *helpers;
+static int nr_helpers;
+
+/* Move ordering keys, highest first. History scores are kept below
+ * ORDER_KILLER by halving the table whenever an entry reaches it.
+ */
+#define ORDER_PV (1 << 30)
+#define ORDER_TT (1 << 29)
+#define ORDER_KILLER (1 << 28)
 
 static void n_swap(int *a, int *b)
 {
@@ -15,98 +50,460 @@ static void n_swap(int *a, int *b)
     *a = *b;
     *b = tmp;
 }
-static void negamax_sort(negamax_context_t *ctx, int *moves, int n_moves)
+
+static void history_age(int *history)
 {
-    for (int i = 0; i < n_moves - 1; i++) {
-        for (int j = i + 1; j < n_moves; j++) {
-            int score_i = 0, score_j = 0;
+    for (int i = 0; i < N_GRIDS; i++)
+        history[i] >>= 1;
+}
 
-            if (ctx->history_count[moves[i]])
-                score_i = ctx->history_score_sum[moves[i]] /
-                          ctx->history_count[moves[i]];
-            if (ctx->history_count[moves[j]])
-                score_j = ctx->history_score_sum[moves[j]] /
-                          ctx->history_count[moves[j]];
+/* Return the previous iteration's PV move of this ply, as long as every
+ * ancestor was reached along that same line.
+ */
+static int negamax_pv_move(negamax_context_t *ctx, int ply)
+{
+    if (!ctx->follow_pv || ply >= ctx->prev_pv_length) {
+        ctx->follow_pv = false;
+        return -1;
+    }
+    return ctx->prev_pv[ply];
+}
 
-            if (score_j > score_i)
-                n_swap(&moves[i], &moves[j]);
+/* Generate the moves of @table into @moves, best first: the PV move, the
+ * transposition table move, the two killers of @ply, then the rest by
+ * history score. Each move is scored once and insertion sorted as it is
+ * generated.
+ */
+static int negamax_order(negamax_context_t *ctx,
+                         const char *table,
+                         int ply,
+                         char player,
+                         int tt_move,
+                         int *moves)
+{
+    const int *history = ctx->history[player == 'X'];
+    const int *killers = ctx->killers[ply];
+    int pv_move = negamax_pv_move(ctx, ply);
+    int scores[N_GRIDS];
+    int n_moves = 0;
+
+    for_each_empty_grid(i, table)
+    {
+        int score = history[i];
+        if (i == pv_move)
+            score = ORDER_PV;
+        else if (i == tt_move)
+            score = ORDER_TT;
+        else if (i == killers[0])
+            score = ORDER_KILLER + 1;
+        else if (i == killers[1])
+            score = ORDER_KILLER;
+
+        int j = n_moves++;
+        for (; j > 0 && scores[j - 1] < score; j--) {
+            scores[j] = scores[j - 1];
+            moves[j] = moves[j - 1];
         }
+        scores[j] = score;
+        moves[j] = i;
+    }
+    if (pv_move != -1 && moves[0] != pv_move)
+        ctx->follow_pv = false;
+    return n_moves;
+}
+
+/* Remember a move that caused a beta cutoff, as a killer of its ply and in
+ * the history table of the side that played it.
+ */
+static void negamax_cutoff(negamax_context_t *ctx,
+                           int ply,
+                           char player,
+                           int move,
+                           int depth)
+{
+    int *killers = ctx->killers[ply];
+    int *history = ctx->history[player == 'X'];
+
+    if (killers[0] != move) {
+        killers[1] = killers[0];
+        killers[0] = move;
+    }
+    history[move] += depth * depth;
+    if (history[move] >= ORDER_KILLER)
+        history_age(history);
+}
+
+/* Give each helper its own order of the moves after the first, so that the
+ * threads spread over different subtrees instead of duplicating work.
+ */
+static void negamax_perturb(negamax_context_t *ctx,
+                            int ply,
+                            int *moves,
+                            int n_moves)
+{
+    if (!ctx->helper || n_moves < 3)
+        return;
+    for (int r = (ctx->helper + ply) % (n_moves - 1); r > 0; r--) {
+        for (int i = 1; i < n_moves - 1; i++)
+            n_swap(&moves[i], &moves[i + 1]);
     }
 }
 
+static bool negamax_aborted(const negamax_context_t *ctx)
+{
+    return ctx->abort && READ_ONCE(*ctx->abort);
+}
+
+static bool negamax_timeout(negamax_context_t *ctx)
+{
+    if (ctx->helper && READ_ONCE(smp_job.generation) != ctx->job)
+        ctx->stopped = true;
+    else if (!(ctx->nodes & TIME_CHECK_MASK) &&
+             (negamax_aborted(ctx) || ktime_after(ktime_get(), ctx->deadline)))
+        ctx->stopped = true;
+    return ctx->stopped;
+}
+
 static move_t negamax(negamax_context_t *ctx,
                       char *table,
                       int depth,
+                      int ply,
                       char player,
                       int alpha,
                       int beta)
 {
+    ctx->nodes++;
+    ctx->pv_length[ply] = ply;
     if (check_win(table) != ' ' || depth == 0) {
         move_t result = {get_score(table, player), -1};
         return result;
     }
-    const zobrist_entry_t *entry = zobrist_get(ctx, ctx->hash_value);
-    if (entry)
-        return (move_t){.score = entry->score, .move = entry->move};
+    if (negamax_timeout(ctx))
+        return (move_t){0, -1};
+
+    zobrist_entry_t entry;
+    int tt_move = -1;
+    if (zobrist_get(ctx->hash_value, &entry)) {
+        tt_move = entry.move;
+        if (ply && entry.depth >= depth &&
+            (entry.flag == ZOBRIST_EXACT ||
+             (entry.flag == ZOBRIST_LOWER && entry.score >= beta) ||
+             (entry.flag == ZOBRIST_UPPER && entry.score <= alpha)))
+            return (move_t){.score = entry.score, .move = entry.move};
+    }
 
     int score;
-    move_t best_move = {-10000, -1};
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
+    int alpha_orig = alpha;
+    move_t best_move = {-SCORE_INF, -1};
+    int moves[N_GRIDS];
+    int n_moves = negamax_order(ctx, table, ply, player, tt_move, moves);
 
-    negamax_sort(ctx, moves, n_moves);
+    negamax_perturb(ctx, ply, moves, n_moves);
 
     for (int i = 0; i < n_moves; i++) {
         table[moves[i]] = player;
-        ctx->hash_value ^= ctx->zobrist_table[moves[i]][player == 'X'];
-        if (!i)
-            score = -negamax(ctx, table, depth - 1, player == 'X' ? 'O' : 'X',
-                             -beta, -alpha)
+        ctx->hash_value ^= zobrist_table[moves[i]][player == 'X'];
+        if (!i) {
+            score = -negamax(ctx, table, depth - 1, ply + 1,
+                             player == 'X' ? 'O' : 'X', -beta, -alpha)
                          .score;
-        else {
-            score = -negamax(ctx, table, depth - 1, player == 'X' ? 'O' : 'X',
-                             -alpha - 1, -alpha)
+            ctx->follow_pv = false;
+        } else {
+            score = -negamax(ctx, table, depth - 1, ply + 1,
+                             player == 'X' ? 'O' : 'X', -alpha - 1, -alpha)
                          .score;
             if (alpha < score && score < beta)
-                score = -negamax(ctx, table, depth - 1,
+                score = -negamax(ctx, table, depth - 1, ply + 1,
                                  player == 'X' ? 'O' : 'X', -beta, -score)
                              .score;
         }
-        ctx->history_count[moves[i]]++;
-        ctx->history_score_sum[moves[i]] += score;
+        table[moves[i]] = ' ';
+        ctx->hash_value ^= zobrist_table[moves[i]][player == 'X'];
+        if (ctx->stopped)
+            break;
         if (score > best_move.score) {
             best_move.score = score;
             best_move.move = moves[i];
         }
-        table[moves[i]] = ' ';
-        ctx->hash_value ^= ctx->zobrist_table[moves[i]][player == 'X'];
-        if (score > alpha)
+        if (score > alpha) {
             alpha = score;
-        if (alpha >= beta)
+            ctx->pv[ply][ply] = moves[i];
+            memcpy(&ctx->pv[ply][ply + 1], &ctx->pv[ply + 1][ply + 1],
+                   sizeof(int) * (ctx->pv_length[ply + 1] - ply - 1));
+            ctx->pv_length[ply] = ctx->pv_length[ply + 1];
+        }
+        if (alpha >= beta) {
+            ctx->cutoffs++;
+            if (!i)
+                ctx->first_cutoffs++;
+            negamax_cutoff(ctx, ply, player, moves[i], depth);
             break;
+        }
     }
 
-    kfree((char *) moves);
-    zobrist_put(ctx, ctx->hash_value, best_move.score, best_move.move);
+    if (ctx->stopped)
+        return best_move;
+
+    char flag = ZOBRIST_EXACT;
+    if (best_move.score <= alpha_orig)
+        flag = ZOBRIST_UPPER;
+    else if (best_move.score >= beta)
+        flag = ZOBRIST_LOWER;
+    zobrist_put(ctx->hash_value, best_move.score, best_move.move, depth, flag);
     return best_move;
 }
 
-void negamax_init(negamax_context_t *ctx)
+static void negamax_begin(negamax_context_t *ctx,
+                          const char *table,
+                          char player)
 {
-    zobrist_init(ctx);
+    /* History carries over from earlier searches, at half weight. Pondering
+     * on moves that may never be played would wipe it for the real ones.
+     */
+    if (!ctx->ponder) {
+        history_age(ctx->history[0]);
+        history_age(ctx->history[1]);
+    }
+    memset(ctx->killers, -1, sizeof(ctx->killers));
+    ctx->hash_value = 0;
+    for (int i = 0; i < N_GRIDS; i++)
+        if (table[i] != ' ')
+            ctx->hash_value ^= zobrist_table[i][table[i] == 'X'];
+    ctx->prev_pv_length = 0;
+    ctx->nodes = 0;
+    ctx->cutoffs = 0;
+    ctx->first_cutoffs = 0;
+    ctx->depth = 0;
+    ctx->result = (move_t){0, -1};
+    ctx->spent_ns = 0;
+    memcpy(ctx->table, table, N_GRIDS);
+    ctx->player = player;
 }
 
-move_t negamax_predict(negamax_context_t *ctx, char *table, char player)
+static move_t negamax_search(negamax_context_t *ctx,
+                             char *table,
+                             char player,
+                             ktime_t deadline,
+                             ktime_t slice_end)
 {
-    memset(&ctx->history_score_sum[0], 0, sizeof(int) * N_GRIDS);
-    memset(&ctx->history_count[0], 0, sizeof(int) * N_GRIDS);
-    ctx->hash_value = 0;
-    move_t result;
-    for (int depth = 2; depth <= MAX_SEARCH_DEPTH; depth += 2) {
-        result = negamax(ctx, table, depth, player, -100000, 100000);
-        zobrist_clear(ctx);
+    if (!ctx->suspended || ctx->player != player ||
+        memcmp(ctx->table, table, N_GRIDS))
+        negamax_begin(ctx, table, player);
+    ctx->suspended = false;
+    ctx->stopped = false;
+
+    bool sliced = ktime_before(slice_end, deadline);
+    ktime_t stop = sliced ? slice_end : deadline;
+    /* The first iteration must finish so that there is a move to return */
+    ctx->deadline = ctx->depth ? stop : KTIME_MAX;
+
+    int n_empty = 0;
+    for_each_empty_grid(i, table)
+        n_empty++;
+
+    ktime_t start = ktime_get();
+    /* Odd helpers run one ply ahead of the main thread, even ones at its
+     * depth, unless they are already deeper
+     */
+    int skew = ctx->helper & 1;
+    while (ctx->depth < n_empty) {
+        int depth = ctx->depth + 1;
+        if (ctx->helper)
+            depth = max(depth, READ_ONCE(smp_job.depth) + skew);
+        depth = min(depth, n_empty);
+        if (ctx->lead)
+            WRITE_ONCE(smp_job.depth, depth);
+
+        int delta = ASPIRATION_WINDOW;
+        int alpha = -SCORE_INF, beta = SCORE_INF;
+        if (ctx->depth) {
+            alpha = max(ctx->result.score - delta, -SCORE_INF);
+            beta = min(ctx->result.score + delta, SCORE_INF);
+        }
+
+        move_t iter;
+        while (1) {
+            ctx->follow_pv = true;
+            iter = negamax(ctx, table, depth, 0, player, alpha, beta);
+            if (ctx->stopped)
+                break;
+            /* Fell outside the aspiration window, widen the failing side */
+            if (iter.score <= alpha && alpha > -SCORE_INF) {
+                delta <<= 1;
+                alpha = max(iter.score - delta, -SCORE_INF);
+            } else if (iter.score >= beta && beta < SCORE_INF) {
+                delta <<= 1;
+                beta = min(iter.score + delta, SCORE_INF);
+            } else
+                break;
+        }
+        ktime_t now = ktime_get();
+        if (ctx->stopped)
+            goto stopped;
+
+        ctx->result = iter;
+        ctx->depth = depth;
+        ctx->prev_pv_length = ctx->pv_length[0];
+        memcpy(ctx->prev_pv, ctx->pv[0], sizeof(int) * ctx->pv_length[0]);
+        ctx->deadline = stop;
+
+        /* The next iteration costs more than all previous ones together, so
+         * do not start it if it cannot finish in the remaining time.
+         */
+        s64 spent = ctx->spent_ns + ktime_to_ns(ktime_sub(now, start));
+        if (ktime_after(now, deadline) ||
+            spent > ktime_to_ns(ktime_sub(deadline, now)))
+            break;
+        if (ktime_after(now, stop))
+            goto stopped;
+    }
+    return ctx->result;
+
+stopped:
+    /* Abandoned iterations are redone from the transposition table */
+    if (!sliced || !ktime_before(ktime_get(), deadline) ||
+        negamax_aborted(ctx))
+        return ctx->result;
+    ctx->spent_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+    ctx->suspended = true;
+    return (move_t){ctx->result.score, SEARCH_YIELD};
+}
+
+static bool negamax_smp_start(const char *table, char player, ktime_t deadline)
+{
+    if (!nr_helpers)
+        return false;
+
+    spin_lock(&smp_job.lock);
+    if (smp_job.active) {
+        spin_unlock(&smp_job.lock);
+        return false;
+    }
+    memcpy(smp_job.table, table, N_GRIDS);
+    smp_job.player = player;
+    smp_job.deadline = deadline;
+    WRITE_ONCE(smp_job.depth, 1);
+    WRITE_ONCE(smp_job.generation, smp_job.generation + 1);
+    WRITE_ONCE(smp_job.active, true);
+    spin_unlock(&smp_job.lock);
+
+    wake_up_all(&smp_job.wait);
+    return true;
+}
+
+static void negamax_smp_stop(void)
+{
+    spin_lock(&smp_job.lock);
+    WRITE_ONCE(smp_job.generation, smp_job.generation + 1);
+    WRITE_ONCE(smp_job.active, false);
+    spin_unlock(&smp_job.lock);
+}
+
+static bool negamax_smp_pending(const negamax_context_t *ctx)
+{
+    return READ_ONCE(smp_job.active) &&
+           READ_ONCE(smp_job.generation) != ctx->job;
+}
+
+static int negamax_helper_func(void *data)
+{
+    struct negamax_helper *helper = data;
+    negamax_context_t *ctx = &helper->ctx;
+    char table[N_GRIDS];
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(
+            smp_job.wait, kthread_should_stop() || negamax_smp_pending(ctx));
+
+        spin_lock(&smp_job.lock);
+        if (!negamax_smp_pending(ctx)) {
+            spin_unlock(&smp_job.lock);
+            continue;
+        }
+        ctx->job = smp_job.generation;
+        memcpy(table, smp_job.table, N_GRIDS);
+        char player = smp_job.player;
+        ktime_t deadline = smp_job.deadline;
+        spin_unlock(&smp_job.lock);
+
+        /* The result only matters through the transposition table */
+        negamax_search(ctx, table, player, deadline, KTIME_MAX);
+    }
+    return 0;
+}
+
+int negamax_init(int n_helpers)
+{
+    int ret = zobrist_init();
+    if (ret)
+        return ret;
+
+    spin_lock_init(&smp_job.lock);
+    init_waitqueue_head(&smp_job.wait);
+    if (n_helpers <= 0)
+        return 0;
+
+    helpers = kcalloc(n_helpers, sizeof(struct negamax_helper), GFP_KERNEL);
+    if (!helpers) {
+        ret = -ENOMEM;
+        goto helpers_fail;
     }
+    for (nr_helpers = 0; nr_helpers < n_helpers; nr_helpers++) {
+        struct negamax_helper *helper = &helpers[nr_helpers];
+        helper->ctx.helper = nr_helpers + 1;
+        helper->task = kthread_run(negamax_helper_func, helper,
+                                   "kxo_negamax/%d", nr_helpers);
+        if (IS_ERR(helper->task)) {
+            ret = PTR_ERR(helper->task);
+            goto kthread_fail;
+        }
+    }
+    return 0;
+
+kthread_fail:
+    negamax_exit();
+    return ret;
+helpers_fail:
+    zobrist_release();
+    return ret;
+}
+
+void negamax_exit(void)
+{
+    for (int i = 0; i < nr_helpers; i++)
+        kthread_stop(helpers[i].task);
+    kfree(helpers);
+    helpers = NULL;
+    nr_helpers = 0;
+    zobrist_release();
+}
+
+move_t negamax_predict(negamax_context_t *ctx,
+                       char *table,
+                       char player,
+                       ktime_t deadline,
+                       ktime_t slice_end)
+{
+    ctx->helper = 0;
+    bool parallel =
+        negamax_smp_start(table, player, ktime_before(slice_end, deadline)
+                                             ? slice_end
+                                             : deadline);
+    ctx->lead = parallel;
+    move_t result = negamax_search(ctx, table, player, deadline, slice_end);
+    if (parallel)
+        negamax_smp_stop();
+    if (result.move == SEARCH_YIELD)
+        return result;
+
+    pr_info(
+        "kxo: negamax depth %d score %d nodes %llu cutoffs %llu "
+        "(%llu%% on first move)%s\n",
+        ctx->depth, result.score, (unsigned long long) ctx->nodes,
+        (unsigned long long) ctx->cutoffs,
+        (unsigned long long) (ctx->cutoffs
+                                  ? ctx->first_cutoffs * 100 / ctx->cutoffs
+                                  : 0),
+        parallel ? " (parallel)" : "");
     return result;
 }
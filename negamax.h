@@ -1,16 +1,84 @@
 #pragma once
+#include <linux/ktime.h>
+
 #include "game.h"
+
+#define MAX_SEARCH_DEPTH N_GRIDS
+
 typedef struct {
     int score, move;
 } move_t;
 
-typedef struct {
-    int history_score_sum[N_GRIDS];
-    int history_count[N_GRIDS];
+typedef struct negamax_context {
+    /* Butterfly history indexed by side to move and square. It persists
+     * across the searches made with this context and is halved before each,
+     * except ponder searches.
+     */
+    int history[2][N_GRIDS];
+    int killers[MAX_SEARCH_DEPTH + 1][2];
     u64 hash_value;
-    u64 zobrist_table[N_GRIDS][2];
-    struct hlist_head *hash_table;
+
+    /* Triangular principal variation table of the iteration in progress and
+     * the line found by the last completed one, searched first on the next.
+     */
+    int pv[MAX_SEARCH_DEPTH + 1][MAX_SEARCH_DEPTH + 1];
+    int pv_length[MAX_SEARCH_DEPTH + 1];
+    int prev_pv[MAX_SEARCH_DEPTH + 1];
+    int prev_pv_length;
+    bool follow_pv;
+
+    ktime_t deadline;
+    bool stopped;
+    u64 nodes;
+    u64 cutoffs, first_cutoffs;
+    int depth; /* deepest completed iteration */
+
+    /* Search suspended at the end of a time slice, resumed after its last
+     * completed iteration when called again on the same position.
+     */
+    bool suspended;
+    const char *abort; /* stops the search as soon as it is set, or NULL */
+    bool ponder;       /* speculative, leaves the history as it is */
+    char table[N_GRIDS];
+    char player;
+    move_t result;
+    s64 spent_ns; /* searching, over all slices */
+
+    /* Lazy SMP helper index, 0 for the thread that returns the result */
+    int helper;
+    bool lead; /* the helpers joined this search, they follow its depth */
+    unsigned int job;
 } negamax_context_t;
 
-void negamax_init(negamax_context_t *ctx);
-move_t negamax_predict(negamax_context_t *ctx, char *table, char player);
\ No newline at end of file
+/**
+ * negamax_init - Set up the shared transposition table and start the helper
+ * threads of the parallel search.
+ *
+ * @n_helpers: Number of helper threads, 0 to always search single-threaded.
+ *
+ * Return: 0 on success, negative errno otherwise.
+ */
+int negamax_init(int n_helpers);
+void negamax_exit(void);
+
+/**
+ * negamax_predict - Iteratively deepen one ply at a time until @deadline.
+ *
+ * @ctx: Search context of the calling thread, zeroed before its first use.
+ * @table: Position to search, restored before returning.
+ * @player: Side to move.
+ * @deadline: Time after which the iteration in progress is abandoned.
+ * @slice_end: Time to suspend the search at, if before @deadline.
+ *
+ * If the helper threads are idle they search the same position alongside the
+ * caller, sharing results through the transposition table only.
+ *
+ * Return: the best move of the deepest completed iteration, or SEARCH_YIELD
+ * as the move once @slice_end has passed. Depth 1 is always completed
+ * regardless of @deadline, but not once ctx->abort is set.
+ */
+move_t negamax_predict(negamax_context_t *ctx,
+                       char *table,
+                       char player,
+                       ktime_t deadline,
+                       ktime_t slice_end);
@@ -0,0 +1,314 @@
+/* Two KXO_IOC_PLAY of the same new game in one io_uring submission, forced
+ * onto io-wq so that they run at once. Plays of a game are serialized: both
+ * must succeed, one for each side. Then two KXO_IOC_READ_EVENTS of a
+ * self-play game at once: readers take turns, no move is read twice. Needs
+ * the module loaded, exits 77 (skipped) where the kernel has no uring_cmd.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../kxo_ioctl.h"
+
+#define XO_DEVICE_FILE "/dev/kxo"
+
+/* Games played at once, two SQEs each, and how many times */
+#define NR_GAMES 128
+#define NR_ROUNDS 32
+
+/* Pairs of reads of one self-play game, and the room of each */
+#define NR_READS 256
+#define READ_ROOM 16
+
+#define SKIP 77
+
+struct ring {
+    int fd;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static int ring_init(struct ring *ring, unsigned int entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -errno;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    void *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ring->fd, IORING_OFF_SQ_RING);
+    void *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd,
+                      IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+        return -errno;
+
+    ring->sq_tail = sq + p.sq_off.tail;
+    ring->sq_mask = sq + p.sq_off.ring_mask;
+    ring->sq_array = sq + p.sq_off.array;
+    ring->cq_head = cq + p.cq_off.head;
+    ring->cq_tail = cq + p.cq_off.tail;
+    ring->cq_mask = cq + p.cq_off.ring_mask;
+    ring->cqes = cq + p.cq_off.cqes;
+    return 0;
+}
+
+/* Queue the n-th SQE past the tail, a command forced onto io-wq */
+static void queue_cmd(struct ring *ring,
+                      int dev,
+                      unsigned int n,
+                      __u32 cmd_op,
+                      const void *arg,
+                      size_t len,
+                      __u64 user_data)
+{
+    unsigned int idx = (*ring->sq_tail + n) & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = dev;
+    sqe->flags = IOSQE_ASYNC;
+    sqe->cmd_op = cmd_op;
+    sqe->user_data = user_data;
+    memcpy(sqe->cmd, arg, len);
+    ring->sq_array[idx] = idx;
+}
+
+static void queue_play(struct ring *ring,
+                       int dev,
+                       unsigned int n,
+                       __u32 game_id,
+                       __u8 move)
+{
+    struct kxo_play play = {.game_id = game_id, .move = move};
+
+    queue_cmd(ring, dev, n, KXO_IOC_PLAY, &play, sizeof(play),
+              (__u64) game_id << 1 | (move & 1));
+}
+
+/* Submit the n queued SQEs, wait for all of them and copy their CQEs to
+ * cqes. Returns 0, 1 if the kernel has no uring_cmd, -1 on failure.
+ */
+static int ring_run(struct ring *ring,
+                    unsigned int n,
+                    struct io_uring_cqe *cqes)
+{
+    atomic_store_explicit((_Atomic unsigned int *) ring->sq_tail,
+                          *ring->sq_tail + n, memory_order_release);
+    int ret = syscall(__NR_io_uring_enter, ring->fd, n, n,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    if ((unsigned int) ret != n) {
+        fprintf(stderr, "io_uring_enter: %d submitted, expected %u\n", ret,
+                n);
+        return -1;
+    }
+
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = atomic_load_explicit(
+        (_Atomic unsigned int *) ring->cq_tail, memory_order_acquire);
+    if (tail - head != n) {
+        fprintf(stderr, "%u completions, expected %u\n", tail - head, n);
+        return -1;
+    }
+    for (unsigned int i = 0; head != tail; head++, i++)
+        cqes[i] = ring->cqes[head & *ring->cq_mask];
+    atomic_store_explicit((_Atomic unsigned int *) ring->cq_head, tail,
+                          memory_order_release);
+
+    for (unsigned int i = 0; i < n; i++) {
+        if (cqes[i].res == -EOPNOTSUPP || cqes[i].res == -ENOTTY) {
+            fprintf(stderr, "no uring_cmd support\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_play(struct ring *ring, int dev)
+{
+    static __u32 games[NR_GAMES];
+    static int results[NR_GAMES][2];
+    static struct io_uring_cqe cqes[2 * NR_GAMES];
+
+    for (int round = 0; round < NR_ROUNDS; round++) {
+        /* Two moves on an empty board, neither can end the game */
+        for (int i = 0; i < NR_GAMES; i++) {
+            struct kxo_new_game game = {.player1 = USER_CTL,
+                                        .player2 = USER_CTL};
+            if (ioctl(dev, KXO_IOC_NEW_GAME, &game)) {
+                perror("KXO_IOC_NEW_GAME");
+                return EXIT_FAILURE;
+            }
+            games[i] = game.game_id;
+            queue_play(ring, dev, 2 * i, games[i], 0);
+            queue_play(ring, dev, 2 * i + 1, games[i], 1);
+        }
+        int ret = ring_run(ring, 2 * NR_GAMES, cqes);
+        if (ret)
+            return ret > 0 ? SKIP : EXIT_FAILURE;
+
+        for (int c = 0; c < 2 * NR_GAMES; c++) {
+            __u32 game_id = cqes[c].user_data >> 1;
+            int i;
+
+            for (i = 0; i < NR_GAMES && games[i] != game_id; i++)
+                ;
+            if (i == NR_GAMES) {
+                fprintf(stderr, "completion of unknown game %u\n", game_id);
+                return EXIT_FAILURE;
+            }
+            results[i][cqes[c].user_data & 1] = cqes[c].res;
+        }
+
+        for (int i = 0; i < NR_GAMES; i++) {
+            int a = results[i][0], b = results[i][1];
+            if (a < 0 || b < 0) {
+                fprintf(stderr, "game %u: play failed: %s\n", games[i],
+                        strerror(-(a < 0 ? a : b)));
+                return EXIT_FAILURE;
+            }
+            /* Bit 4 is set for 'X', each side played once */
+            if (((a ^ b) & (1 << 4)) == 0) {
+                fprintf(stderr, "game %u: both moves by %c\n", games[i],
+                        a & (1 << 4) ? 'X' : 'O');
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static int cmp_time(const void *a, const void *b)
+{
+    __u64 x = ((const struct kxo_event *) a)->time_ns;
+    __u64 y = ((const struct kxo_event *) b)->time_ns;
+
+    return (x > y) - (x < y);
+}
+
+/* Moves of a game are played one at a time, their times tell them apart */
+static int test_read_events(struct ring *ring)
+{
+    static struct kxo_event events[2 * READ_ROOM];
+    struct io_uring_cqe cqes[2];
+    __u64 last = 0;
+    long moves = 0;
+
+    /* A file of its own, where the only moves are those of this game */
+    int dev = open(XO_DEVICE_FILE, O_RDWR);
+    if (dev < 0) {
+        perror(XO_DEVICE_FILE);
+        return EXIT_FAILURE;
+    }
+    struct kxo_new_game game = {.player1 = NEGAMAX, .player2 = NEGAMAX};
+    if (ioctl(dev, KXO_IOC_NEW_GAME, &game)) {
+        perror("KXO_IOC_NEW_GAME");
+        return EXIT_FAILURE;
+    }
+    struct kxo_game_pace pace = {.game_id = game.game_id, .pace_us = 0};
+    if (ioctl(dev, KXO_IOC_SET_PACE, &pace)) {
+        perror("KXO_IOC_SET_PACE");
+        return EXIT_FAILURE;
+    }
+
+    for (int round = 0; round < NR_READS; round++) {
+        for (int r = 0; r < 2; r++) {
+            struct kxo_read_events rd = {
+                .buf = (uintptr_t) &events[r * READ_ROOM],
+                .nr = READ_ROOM,
+            };
+            queue_cmd(ring, dev, r, KXO_IOC_READ_EVENTS, &rd, sizeof(rd), r);
+        }
+        memset(events, 0, sizeof(events));
+        int ret = ring_run(ring, 2, cqes);
+        if (ret)
+            return ret > 0 ? SKIP : EXIT_FAILURE;
+
+        int got[2], n = 0;
+        for (int c = 0; c < 2; c++) {
+            int res = cqes[c].res;
+            if (res < 0 || res > READ_ROOM) {
+                fprintf(stderr, "read %d: %s\n", round,
+                        res < 0 ? strerror(-res) : "overflow");
+                return EXIT_FAILURE;
+            }
+            got[cqes[c].user_data & 1] = res;
+        }
+        /* Pack the events both reads returned, then look for twins */
+        for (int r = 0; r < 2; r++) {
+            memmove(&events[n], &events[r * READ_ROOM],
+                    got[r] * sizeof(*events));
+            n += got[r];
+        }
+        qsort(events, n, sizeof(*events), cmp_time);
+        for (int i = 0; i < n; i++) {
+            if (events[i].game_id != game.game_id) {
+                fprintf(stderr, "event of unknown game %u\n",
+                        events[i].game_id);
+                return EXIT_FAILURE;
+            }
+            if (events[i].time_ns <= last) {
+                fprintf(stderr, "move played at %llu read twice\n",
+                        (unsigned long long) events[i].time_ns);
+                return EXIT_FAILURE;
+            }
+            last = events[i].time_ns;
+        }
+        moves += n;
+    }
+
+    close(dev);
+    printf("uring-play: %ld moves read by %d pairs of readers\n", moves,
+           NR_READS);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    struct ring ring;
+    int dev = open(XO_DEVICE_FILE, O_RDWR);
+
+    if (dev < 0) {
+        perror(XO_DEVICE_FILE);
+        return SKIP;
+    }
+
+    int ret = ring_init(&ring, 2 * NR_GAMES);
+    if (ret) {
+        fprintf(stderr, "io_uring_setup: %s\n", strerror(-ret));
+        return SKIP;
+    }
+
+    ret = test_play(&ring, dev);
+    if (ret != EXIT_SUCCESS)
+        return ret;
+    printf("uring-play: %d games, %d rounds: ok\n", NR_GAMES, NR_ROUNDS);
+
+    return test_read_events(&ring);
+}
@@ -1,37 +1,107 @@
 #ifndef TYPE_H
 #define TYPE_H
+#include <linux/atomic.h>
 #include <linux/kfifo.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/timerqueue.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include "kxo_budget.h"
+#include "kxo_hybrid.h"
+#include "kxo_ring.h"
 #include "lock_free_list.h"
-
-typedef int (*ai_func_t)(const char *table, char turn);
+#include "mcts.h"
 
 typedef struct user_data UserData;
+struct eventfd_ctx;
+struct kxo_boards;
+struct kxo_watcher;
+struct kxo_runq;
+
+/* Returns the move to play for player on table, a position of the game
+ * user_data, searching until deadline. Returns SEARCH_YIELD at slice_end if
+ * that comes first, the search state is kept in user_data for the next call.
+ * A ponder search is speculative: it must leave the state that carries over
+ * between the real moves of the game, and the statistics, untouched.
+ */
+typedef int (*ai_func_t)(UserData *user_data,
+                         const char *table,
+                         char player,
+                         ktime_t deadline,
+                         ktime_t slice_end,
+                         bool ponder);
+
+/* AI replies searched while a human is to move */
+struct kxo_ponder {
+    char table[16];         // position the human is to move in
+    char player;            // the AI, who replies
+    signed char order[16];  // human moves, most likely first
+    signed char reply[16];  // AI reply to each human move, -1 if unknown
+    int n_moves, next;      // in order, and the next one to search
+    bool searching;         // the reply to order[next] yielded
+    ktime_t deadline;       // of that search
+};
 
 typedef struct tid_data {
-    pid_t tid;
-    UserData **user_data_list;
-    struct hlist_node hlist;
+    pid_t tid;  // that opened the session
+    u32 session_id;  // for spectators, unique until it wraps around
+    kuid_t uid;      // of the opener, spectators of other users are blind
+    struct xarray games;  // by id
     struct wait_queue_head tid_wait;
-    unsigned char user_cnt;
+    refcount_t ref;  // held by the open file and by each of its games
+    struct kxo_budget *budget;  // of the process that opened the session
+    struct kxo_ring *ring;     // NULL until userspace maps it
+    struct kxo_boards *boards;  // NULL until userspace maps them
+    struct mutex read_lock;     // one reader of the fifos of its games at once
+    unsigned long read_cursor;  // game KXO_IOC_READ_EVENTS starts from
+    struct xarray eventfds;       // signalled on the moves of a game, by id
+    struct eventfd_ctx *eventfd;  // signalled on every move
+    struct kxo_watcher *watcher;  // NULL unless spectating
 } TidData;
 
+/* A game. Fields are grouped by who touches them: the first cache line is
+ * read on every move and every ioctl, the scheduling state by the workers
+ * and the timers, the search state only by the engine playing the game.
+ * Allocated from a cache of its own, so an idle game costs sizeof(UserData)
+ * rounded up to a cache line, 448 bytes on x86-64 without lock debugging,
+ * plus a fifo of kxo_sched_fifo_size() 8-byte moves and its slot in the
+ * xarray of its session.
+ */
 typedef struct user_data {
     char table[16];
     char turn;           //'O' or 'X'
-    char unuse;          // tasklet function will release user_data if unuse
+    char unuse;          // set on close, aborts the searches of the game
+    u32 id;              // in the games of tid_data
     ai_func_t ai1_func;  //'O', if NULL mean user space control
     ai_func_t ai2_func;  //'X', if NULL mean user space control
-
-    struct work_struct work;
-
-    DECLARE_KFIFO_PTR(user_fifo, unsigned char);
-
     TidData *tid_data;
+    int cpu;               // home CPU, moves run there
+    int qos;               // enum kxo_qos_class
+    unsigned int pace_us;  // time between two AI-vs-AI moves, 0 for no wait
+    atomic_t queued;       // set while on a run queue
 
+    struct kxo_runq *runq;            // that run queue, under its lock
+    struct timerqueue_node run_node;  // on a run queue, keyed by deadline
+    struct timerqueue_node pace_node;  // when the next move is due
+    ktime_t runnable_at;
+    ktime_t search_deadline;  // when the engine must return its move
+    ktime_t slice_end;        // when the engine must yield the CPU
+    atomic64_t parked_since;  // ns, 0 unless its fifo is too full
+    bool suspended;           // the engine yielded before finding the move
+
+    DECLARE_KFIFO_PTR(user_fifo, u64);  // moves, with when they were played
     struct lf_list hlist;
+
+    struct mutex search_lock;  // held by whoever runs an engine on the game
+    struct list_head ponder_node;  // on a ponder list while pondering
+    struct kxo_ponder ponder;
+    struct negamax_context *negamax_ctx;  // allocated on first negamax move
+    struct mcts_search mcts;              // tree of a suspended MCTS
+    struct kxo_hybrid hybrid;             // method of the hybrid engine
 } UserData;
 
 #endif
\ No newline at end of file
@@ -1,48 +1,120 @@
 #include "user_data.h"
+#include "kxo_board.h"
+#include "kxo_ioctl.h"
+#include "kxo_notify.h"
+#include "kxo_ponder.h"
+#include "kxo_sched.h"
+#include "kxo_watch.h"
+
+/* A move in the fifo of its game: its encoding for read() in the top byte,
+ * and the low bits of the time it was played
+ */
+#define KXO_STAMP_BITS 56
+#define KXO_STAMP_MASK ((1ULL << KXO_STAMP_BITS) - 1)
 
 static void produce_board(UserData *user_data, int move, char is_win)
 {
+    /* Published when mapped, the ring is set up by then */
+    if (kxo_ring_push(smp_load_acquire(&user_data->tid_data->ring),
+                      user_data->id, move, user_data->turn ^ 'O' ^ 'X',
+                      is_win))
+        return;
+
     char buffer;
     WRITE_ONCE(buffer, (char) move +
                            (((user_data->turn ^ 'O' ^ 'X') == 'X') << 4) +
                            ((is_win != ' ') << 5) + ((is_win == 'D') << 6));
     smp_mb();
-    unsigned int len = kfifo_in(
-        &user_data->user_fifo, (const unsigned char *) &buffer, sizeof(buffer));
-    if (unlikely(len < sizeof(buffer)))
-        pr_warn_ratelimited("%s: %zu bytes dropped\n", __func__,
-                            sizeof(buffer) - len);
-
-    pr_info("kxo: %s: in %u/%u bytes\n", __func__, len,
+    u64 record = (u64) (unsigned char) buffer << KXO_STAMP_BITS |
+                 (ktime_get_ns() & KXO_STAMP_MASK);
+    unsigned int len = kfifo_put(&user_data->user_fifo, record);
+    if (unlikely(!len))
+        pr_warn_ratelimited("%s: move dropped\n", __func__);
+    else
+        xa_set_mark(&user_data->tid_data->games, user_data->id,
+                    KXO_GAME_READABLE);
+
+    pr_info("kxo: %s: in %u/%u moves\n", __func__, len,
             kfifo_len(&user_data->user_fifo));
 }
-static void ai_work_func(struct work_struct *w)
+
+unsigned int peek_events(UserData *user_data,
+                         struct kxo_event *events,
+                         unsigned int n)
+{
+    u64 now = ktime_get_ns(), records[16];
+    unsigned int i;
+
+    n = kfifo_out_peek(&user_data->user_fifo, records,
+                       min_t(unsigned int, n, ARRAY_SIZE(records)));
+    for (i = 0; i < n; i++) {
+        u64 record = records[i];
+        unsigned char code = record >> KXO_STAMP_BITS;
+        struct kxo_event *event = &events[i];
+
+        /* Played less than 2^56 ns ago */
+        event->time_ns = now - ((now - record) & KXO_STAMP_MASK);
+        event->game_id = user_data->id;
+        event->move = code & 0x0f;
+        event->player = code & (1 << 4) ? 'X' : 'O';
+        event->flags = !(code & (1 << 5))  ? 0
+                       : code & (1 << 6) ? KXO_EVENT_DRAW
+                                         : KXO_EVENT_WIN;
+        event->pad = 0;
+    }
+    return n;
+}
+
+void drop_events(UserData *user_data, unsigned int n)
+{
+    while (n--)
+        kfifo_skip(&user_data->user_fifo);
+}
+bool ai_play_move(UserData *user_data)
 {
     WARN_ON_ONCE(in_softirq());
     WARN_ON_ONCE(in_interrupt());
 
-    int cpu;
-    cpu = get_cpu();
+    mutex_lock(&user_data->search_lock);
+
+    /* Preemptible, the CPU is only reported */
+    int cpu = raw_smp_processor_id();
+    bool done = true;
     pr_info("kxo: [CPU#%d] start doing %s\n", cpu, __func__);
 
     ktime_t tv_start, tv_end;
     s64 nsecs;
     tv_start = ktime_get();
 
-    UserData *user_data = container_of(w, UserData, work);
     smp_mb();
     ai_func_t ai_func = get_turn_function(user_data);
     smp_mb();
 
-    if (ai_func == NULL)
+    /* Closed while waiting for the search_lock */
+    if (ai_func == NULL || READ_ONCE(user_data->unuse))
         goto null_func;
 
     smp_mb();
 
-    int move;
-    WRITE_ONCE(move, ai_func(user_data->table, user_data->turn));
+    int move = user_data->suspended ? -1 : kxo_ponder_lookup(user_data);
+    if (move < 0)
+        WRITE_ONCE(move, ai_func(user_data, user_data->table, user_data->turn,
+                                 user_data->search_deadline,
+                                 user_data->slice_end, false));
     smp_mb();
 
+    /* Aborted, nobody is going to read the move */
+    if (READ_ONCE(user_data->unuse)) {
+        user_data->suspended = false;
+        goto null_func;
+    }
+
+    user_data->suspended = move == SEARCH_YIELD;
+    if (user_data->suspended) {
+        done = false;
+        goto null_func;
+    }
+
     if (move != -1)
         WRITE_ONCE(user_data->table[move], user_data->turn);
 
@@ -53,47 +125,81 @@ static void ai_work_func(struct work_struct *w)
     WRITE_ONCE(win, check_win(user_data->table));
     smp_mb();
 
+    kxo_board_update(user_data, win);
+    kxo_watch_publish(user_data, move, user_data->turn ^ 'O' ^ 'X', win);
     produce_board(user_data, move, win);
 
     smp_mb();
 
-    wake_up_interruptible(&user_data->tid_data->tid_wait);
+    kxo_notify(user_data);
 
     if (win != ' ')
         reset_user_data_table(user_data);
 
+    if (!get_turn_function(user_data))
+        kxo_ponder_start(user_data);
+    kxo_sched_game_ready(user_data);
+
 null_func:
-    put_cpu();
+    mutex_unlock(&user_data->search_lock);
     tv_end = ktime_get();
     nsecs = (s64) ktime_to_ns(ktime_sub(tv_end, tv_start));
-    pr_info("kxo: [CPU#%d] %s completed in %llu usec\n", cpu, __func__,
-            (unsigned long long) nsecs >> 10);
+    pr_info("kxo: [CPU#%d] %s %s in %llu usec\n", cpu, __func__,
+            done ? "completed" : "yielded", (unsigned long long) nsecs >> 10);
+    return done;
 }
 
 UserData *init_user_data(ai_func_t ai1_func,
                          ai_func_t ai2_func,
                          TidData *tid_data)
 {
-    UserData *user_data = vmalloc(sizeof(UserData));
+    int cpu = kxo_sched_pick_cpu();
+    int node = cpu_to_node(cpu);
+    UserData *user_data =
+        kmem_cache_alloc_node(user_data_cache, GFP_KERNEL, node);
 
     if (!user_data)
         goto user_data_alloc_fail;
 
+    user_data->cpu = cpu;
+
     reset_user_data_table(user_data);
     WRITE_ONCE(user_data->unuse, 0);
+    user_data->pace_us = kxo_sched_default_pace();
+    timerqueue_init(&user_data->pace_node);
     user_data->ai1_func = ai1_func;
     user_data->ai2_func = ai2_func;
+    user_data->qos = ai1_func && ai2_func ? KXO_QOS_BACKGROUND
+                                          : KXO_QOS_INTERACTIVE;
     user_data->tid_data = tid_data;
-
-    INIT_WORK(&user_data->work, ai_work_func);
-
-    if (kfifo_alloc(&user_data->user_fifo, PAGE_SIZE, GFP_KERNEL) < 0)
+    user_data->negamax_ctx = NULL;
+    user_data->mcts.root = NULL;
+    user_data->mcts.abort = &user_data->unuse;
+    user_data->hybrid.searching = false;
+    user_data->suspended = false;
+
+    timerqueue_init(&user_data->run_node);
+    atomic_set(&user_data->queued, 0);
+    user_data->runq = NULL;
+    atomic64_set(&user_data->parked_since, 0);
+    mutex_init(&user_data->search_lock);
+    user_data->ponder.n_moves = 0;
+    INIT_LIST_HEAD(&user_data->ponder_node);
+
+    /* kfifo_alloc() has no node argument, kfifo_free() still works. Sized
+     * for the moves a game may have unread before it is parked.
+     */
+    unsigned int size = kxo_sched_fifo_size() * sizeof(u64);
+    void *buffer = kmalloc_node(size, GFP_KERNEL, node);
+    if (!buffer)
         goto kfifo_alloc_fail;
+    kfifo_init(&user_data->user_fifo, buffer, size);
 
     return user_data;
 
 kfifo_alloc_fail:
-    vfree(user_data);
+    kmem_cache_free(user_data_cache, user_data);
 user_data_alloc_fail:
+    kxo_sched_put_cpu(cpu);
     return NULL;
 }
@@ -4,26 +4,49 @@
 #include <linux/atomic.h>
 #include <linux/kfifo.h>
 #include <linux/list.h>
-#include <linux/vmalloc.h>
+#include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
 #include "negamax.h"
 
 #include "game.h"
 #include "kxo_namespace.h"
+#include "kxo_sched.h"
 #include "lock_free_list.h"
 #include "type.h"
 
+/* Allocates the games, set up by init_namespace() */
+extern struct kmem_cache *user_data_cache;
+
 UserData *init_user_data(ai_func_t ai1_func,
                          ai_func_t ai2_func,
                          TidData *tid_data);
 
+/* Search the AI move of the player whose turn it is and play it, run by the
+ * worker pool. Returns false if the search yielded at user_data->slice_end
+ * and has to be resumed.
+ */
+bool ai_play_move(UserData *user_data);
+
+/* Copy up to 16 of the n first moves of the fifo of a game, returns how
+ * many. They stay there until drop_events() removes them, once delivered.
+ */
+unsigned int peek_events(UserData *user_data,
+                         struct kxo_event *events,
+                         unsigned int n);
+void drop_events(UserData *user_data, unsigned int n);
+
 
 static void release_user_data(UserData **user_data)
 {
     kfifo_free(&(*user_data)->user_fifo);
+    kfree((*user_data)->negamax_ctx);
+    // before its process, which owns the search memory
+    if ((*user_data)->mcts.root)
+        mcts_release(&(*user_data)->mcts, (*user_data)->tid_data->budget);
+    kxo_sched_put_cpu((*user_data)->cpu);
     smp_mb();
-    vfree(*user_data);
+    kmem_cache_free(user_data_cache, *user_data);
     *user_data = NULL;
 };
 
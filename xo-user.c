@@ -124,6 +124,8 @@ int arg_to_int(char arg)
         return 1;
     case 'n':
         return 2;
+    case 'h':
+        return 3;
     case 't':
         return 16;
     default:
@@ -138,7 +140,7 @@ int main(int argc, const char *argv[])
     wrong_input:
         printf("Please input two value for player1 and player2\n");
         printf("Player type:\n");
-        printf("RANDOM: r\nMCTS: m\nNEGAMAX: n\nTD_LEARNING: t\n");
+        printf("RANDOM: r\nMCTS: m\nNEGAMAX: n\nHYBRID: h\nTD_LEARNING: t\n");
         return 0;
     }
     int player1 = arg_to_int(argv[1][0]), player2 = arg_to_int(argv[2][0]);
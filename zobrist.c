@@ -4,6 +4,28 @@
 
 #define HASH(key) ((key) % HASH_TABLE_SIZE)
 
+/* One table slot. @check is the key XORed with @data, so a reader racing
+ * with a writer sees a mismatch instead of another position's entry.
+ */
+struct zobrist_slot {
+    u64 check;
+    u64 data;
+};
+
+u64 zobrist_table[N_GRIDS][2];
+static struct zobrist_slot *hash_table;
+
+#define DATA_SCORE(d) ((int) (s32) (d))
+#define DATA_MOVE(d) ((int) (((d) >> 32) & 0xff) - 1)
+#define DATA_DEPTH(d) ((int) (((d) >> 40) & 0xff))
+#define DATA_FLAG(d) ((char) (((d) >> 48) & 0xff))
+
+static inline u64 pack_data(int score, int move, int depth, char flag)
+{
+    return (u64) (u32) score | (u64) ((move + 1) & 0xff) << 32 |
+           (u64) (depth & 0xff) << 40 | (u64) (flag & 0xff) << 48;
+}
+
 /* See https://github.com/wangyi-fudan/wyhash
  */
 static inline u64 wyhash64_stateless(u64 *seed)
@@ -23,58 +45,54 @@ static u64 wyhash64(void)
     return wyhash64_stateless(&seed);
 }
 
-void zobrist_init(negamax_context_t *ctx)
+int zobrist_init(void)
 {
     int i;
     for (i = 0; i < N_GRIDS; i++) {
-        ctx->zobrist_table[i][0] = wyhash64();
-        ctx->zobrist_table[i][1] = wyhash64();
+        zobrist_table[i][0] = wyhash64();
+        zobrist_table[i][1] = wyhash64();
     }
-    ctx->hash_table =
-        kmalloc(sizeof(struct hlist_head) * HASH_TABLE_SIZE, GFP_KERNEL);
-    if (!ctx->hash_table) {
+    hash_table =
+        kvcalloc(HASH_TABLE_SIZE, sizeof(struct zobrist_slot), GFP_KERNEL);
+    if (!hash_table) {
         pr_info("kxo: Failed to allocate space for hash_table\n");
-        return;
+        return -ENOMEM;
     }
-    for (i = 0; i < HASH_TABLE_SIZE; i++)
-        INIT_HLIST_HEAD(&(ctx->hash_table[i]));
+    return 0;
 }
 
-zobrist_entry_t *zobrist_get(negamax_context_t *ctx, u64 key)
+bool zobrist_get(u64 key, zobrist_entry_t *entry)
 {
-    unsigned long long hash_key = HASH(key);
+    struct zobrist_slot *slot = &hash_table[HASH(key)];
+    u64 data = READ_ONCE(slot->data);
 
-    if (hlist_empty(&(ctx->hash_table[hash_key])))
-        return NULL;
+    if (!data || (READ_ONCE(slot->check) ^ data) != key)
+        return false;
 
-    zobrist_entry_t *entry = NULL;
-
-    hlist_for_each_entry(entry, &(ctx->hash_table[hash_key]), ht_list) {
-        if (entry->key == key)
-            return entry;
-    }
-    return NULL;
+    entry->score = DATA_SCORE(data);
+    entry->move = DATA_MOVE(data);
+    entry->depth = DATA_DEPTH(data);
+    entry->flag = DATA_FLAG(data);
+    return true;
 }
 
-void zobrist_put(negamax_context_t *ctx, u64 key, int score, int move)
+void zobrist_put(u64 key, int score, int move, int depth, char flag)
 {
-    unsigned long long hash_key = HASH(key);
-    zobrist_entry_t *new_entry = kmalloc(sizeof(zobrist_entry_t), GFP_KERNEL);
-    new_entry->key = key;
-    new_entry->move = move;
-    new_entry->score = score;
-    hlist_add_head(&new_entry->ht_list, &(ctx->hash_table[hash_key]));
+    struct zobrist_slot *slot = &hash_table[HASH(key)];
+    u64 old = READ_ONCE(slot->data);
+
+    /* Keep a deeper result for the same position */
+    if (old && (READ_ONCE(slot->check) ^ old) == key &&
+        DATA_DEPTH(old) > depth)
+        return;
+
+    u64 data = pack_data(score, move, depth, flag);
+    WRITE_ONCE(slot->check, key ^ data);
+    WRITE_ONCE(slot->data, data);
 }
 
-void zobrist_clear(negamax_context_t *ctx)
+void zobrist_release(void)
 {
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        while (!hlist_empty(&(ctx->hash_table[i]))) {
-            zobrist_entry_t *entry = hlist_entry((ctx->hash_table[i]).first,
-                                                 zobrist_entry_t, ht_list);
-            hlist_del(&entry->ht_list);
-            kfree(entry);
-        }
-        INIT_HLIST_HEAD(&(ctx->hash_table[i]));
-    }
-}
\ No newline at end of file
+    kvfree(hash_table);
+    hash_table = NULL;
+}
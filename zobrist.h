@@ -1,22 +1,28 @@
 #pragma once
 
-#include <linux/list.h>
-#include "negamax.h"
+#include <linux/types.h>
 
 #include "game.h"
 
 #define HASH_TABLE_SIZE (100003)
 
-// extern u64 zobrist_table[N_GRIDS][2];
+extern u64 zobrist_table[N_GRIDS][2];
+
+/* How the stored score bounds the true value of the position */
+enum { ZOBRIST_EXACT, ZOBRIST_LOWER, ZOBRIST_UPPER };
 
 typedef struct {
-    u64 key;
     int score;
     int move;
-    struct hlist_node ht_list;
+    int depth;
+    char flag;
 } zobrist_entry_t;
 
-void zobrist_init(negamax_context_t *ctx);
-zobrist_entry_t *zobrist_get(negamax_context_t *ctx, u64 key);
-void zobrist_put(negamax_context_t *ctx, u64 key, int score, int move);
-void zobrist_clear(negamax_context_t *ctx);
\ No newline at end of file
+/* The transposition table is shared by every negamax search, including the
+ * helper threads of a parallel search. Entries are written without locking
+ * and a torn entry is detected and treated as a miss.
+ */
+int zobrist_init(void);
+bool zobrist_get(u64 key, zobrist_entry_t *entry);
+void zobrist_put(u64 key, int score, int move, int depth, char flag);
+void zobrist_release(void);